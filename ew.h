@@ -0,0 +1,67 @@
+/* libew - the ew version control core as a library
+ *
+ * A repository is opened once and then driven through the functions
+ * below. Paths are relative to the repository root; every call runs
+ * with the working directory moved there and back, so a process must
+ * not call into libew from more than one thread at a time. Anything a
+ * command reports is passed to the output callback (stdout when none
+ * is set), always from the calling process; forked workers of revert
+ * --at and grep hand their output back over pipes. */
+
+#ifndef EW_H
+#define EW_H
+
+#include <stddef.h>
+
+typedef enum
+{
+	EW_OK = 0,
+	EW_ERR_NO_REPO = -1,
+	EW_ERR_NO_HISTORY = -2,
+	EW_ERR_NO_FILE = -3,
+	EW_ERR_INVALID_VERSION = -4,
+	EW_ERR_FILE_NOT_TRACKED = -5,
+	EW_ERR_BINARY_FILE = -6,
+	EW_ERR_UNKNOWN_COMMAND = -7,
+	EW_ERR_NO_MEMORY = -8,
+	EW_ERR_IO = -9,
+	EW_ERR_INVALID_TIME = -10,
+	EW_ERR_FILE_EXISTS = -11,
+	EW_ERR_CORRUPT = -12,
+	EW_ERR_INVALID_PATTERN = -13
+} ErrorCode;
+
+/* keep the index and version table in memory between calls */
+#define EW_OPEN_CACHED 1
+
+typedef struct EwRepo EwRepo;
+
+typedef struct
+{
+	const char *path;
+	char state;			/* 'M' modified, 'D' deleted, ' ' unchanged */
+	int version;		/* latest saved version, 0 if none */
+} EwFileStatus;
+
+typedef void (*EwOutput)(void *ctx, const char *text, size_t len);
+typedef int (*EwStatusFn)(void *ctx, const EwFileStatus *file);	/* nonzero stops */
+
+EwRepo *ew_open(const char *path, int flags, ErrorCode *error);
+void ew_close(EwRepo *repo);
+void ew_set_output(EwRepo *repo, EwOutput output, void *ctx);
+void ew_set_color(EwRepo *repo, int color);
+const char *ew_strerror(ErrorCode error);
+
+/* runs any command as the ew binary would, argv[1] being its name */
+ErrorCode ew_run(EwRepo *repo, int argc, char *argv[]);
+/* hands the command to a running daemon; -1 if there is none */
+int ew_forward(EwRepo *repo, int argc, char *argv[]);
+
+ErrorCode ew_track(EwRepo *repo, const char *path);
+ErrorCode ew_untrack(EwRepo *repo, const char *path);
+ErrorCode ew_save(EwRepo *repo, const char *path, int *version);
+ErrorCode ew_diff(EwRepo *repo, const char *path);
+ErrorCode ew_revert(EwRepo *repo, const char *path, int version);
+ErrorCode ew_status(EwRepo *repo, EwStatusFn fn, void *ctx);
+
+#endif
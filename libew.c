@@ -0,0 +1,6853 @@
+#define _GNU_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <regex.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <stdarg.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ew.h"
+
+/* the public error codes under their short names */
+#define SUCCESS EW_OK
+#define ERR_NO_REPO EW_ERR_NO_REPO
+#define ERR_NO_HISTORY EW_ERR_NO_HISTORY
+#define ERR_NO_FILE EW_ERR_NO_FILE
+#define ERR_INVALID_VERSION EW_ERR_INVALID_VERSION
+#define ERR_FILE_NOT_TRACKED EW_ERR_FILE_NOT_TRACKED
+#define ERR_BINARY_FILE EW_ERR_BINARY_FILE
+#define ERR_UNKNOWN_COMMAND EW_ERR_UNKNOWN_COMMAND
+#define ERR_NO_MEMORY EW_ERR_NO_MEMORY
+#define ERR_IO EW_ERR_IO
+#define ERR_INVALID_TIME EW_ERR_INVALID_TIME
+#define ERR_FILE_EXISTS EW_ERR_FILE_EXISTS
+#define ERR_CORRUPT EW_ERR_CORRUPT
+#define ERR_INVALID_PATTERN EW_ERR_INVALID_PATTERN
+
+/* macros */
+#define MAX_LINES 1000
+#define MAX_LINE_LENGTH 256
+#define MAX_PATH 1024
+#define MAX_COMMAND 128
+#define MAX_FILES 1024
+#define ARENA_BLOCK (1UL << 20)
+#define ARENA_LIMIT (256UL << 20)
+
+#define VCS_DIR ".svcs"
+#define HISTORY_FILE ".svcs/history"
+#define BACKUP_DIR ".svcs/versions"
+#define INDEX_FILE ".svcs/index"
+#define SOCKET_FILE ".svcs/sock"
+#define CLIENT_TIMEOUT 500
+#define PACK_FILE ".svcs/pack"
+#define PACK_MAGIC "EWPACK1"
+#define PACK_DEPTH 16
+#define PACK_DEAD_SHARE 4
+#define WAL_FILE ".svcs/wal"
+#define WAL_MAGIC 0x4c415745u
+#define WAL_CHECKPOINT (16 << 20)
+#define BOOT_ID_LEN 36
+#define LOCK_FILE ".svcs/lock"
+#define OBJECT_DIR ".svcs/objects"
+#define SNAPSHOT_FILE ".svcs/snapshots"
+#define CONFIG_FILE ".svcs/config"
+#define MOVES_FILE ".svcs/moves"
+#define RENAME_SCORE 50
+#define TIME_INDEX ".svcs/timeidx"
+#define SUMS_FILE ".svcs/sums"
+#define SUMS_MAGIC "EWSUMS1"
+#define QUARANTINE_DIR ".svcs/quarantine"
+#define TIME_MAGIC "EWTIME1"
+#define ARCHIVE_MAGIC "EWARCH1"
+#define IMPORT_DIR ".svcs.import"
+#define LOCK_STORE 0
+#define LOCK_VERSIONS 16
+#define LOCK_SLOTS (1 << 16)
+
+#define PRINT_SUCCESS(fmt, str) say("%s" fmt "%s\n", GREEN, str, RESET)
+#define PRINT_ERROR(msg, ...) say("%s" msg "%s\n", RED, ##__VA_ARGS__, RESET)
+#define CHECK_ARGS(n) if (argc < n) return ERR_NO_FILE
+#define CHECK_FILE(f) if (access(f, F_OK) != 0) return ERR_NO_FILE
+#define CHECK_REPO() if (access(VCS_DIR, F_OK) != 0) return ERR_NO_REPO
+#define CHECK_HISTORY() if (access(HISTORY_FILE, F_OK) != 0) return ERR_NO_HISTORY
+#define CHECK_TRACKED(f) if (!is_tracked(f)) return ERR_FILE_NOT_TRACKED
+
+/* colors */
+#define RED (repo->color ? "\x1b[31m" : "")
+#define GREEN (repo->color ? "\x1b[32m" : "")
+#define YELLOW (repo->color ? "\x1b[33m" : "")
+#define RESET (repo->color ? "\x1b[0m" : "")
+#define CYAN (repo->color ? "\x1b[36m" : "")
+
+typedef enum
+{
+	CMD_INIT,
+	CMD_DIFF,
+	CMD_FIND,
+	CMD_SAVE,
+	CMD_REVERT,
+	CMD_HISTORY,
+	CMD_STATUS,
+	CMD_TRACK,
+	CMD_UNTRACK,
+	CMD_DAEMON,
+	CMD_GC,
+	CMD_SNAPSHOT,
+	CMD_RESTORE,
+	CMD_GREP,
+	CMD_EXPORT,
+	CMD_IMPORT,
+	CMD_PRUNE,
+	CMD_MV,
+	CMD_FSCK,
+	CMD_UNKNOWN
+} Command;
+
+/* types */
+typedef struct ArenaBlock
+{
+	struct ArenaBlock *next;
+	size_t used;
+	size_t size;
+	char data[];
+} ArenaBlock;
+
+typedef struct
+{
+	ArenaBlock *head;
+	size_t total;
+	size_t limit;
+} Arena;
+
+typedef struct
+{
+	ArenaBlock *block;
+	size_t used;
+	size_t total;
+} ArenaMark;
+
+typedef struct
+{
+	char *data;
+	size_t len;
+} Blob;
+
+typedef struct
+{
+	char **lines;
+	int line_count;
+} FileContents;
+
+/* an edit script: types[k] is '+', '-' or ' ' for lines[k] */
+typedef struct
+{
+	char **a;
+	char **b;
+	uint64_t *ha;
+	uint64_t *hb;
+	int *fwd;
+	int *rev;
+	char *types;
+	char **lines;
+	int count;
+} DiffScript;
+
+typedef struct
+{
+	char filename[MAX_PATH];
+	char username[MAX_PATH];
+	time_t timestamp;
+	int version;
+	int lines_added;
+	int lines_removed;
+	char changed_lines[MAX_LINES][MAX_LINE_LENGTH];
+	int num_changes;
+	char change_types[MAX_LINES];
+} EnhancedVersionInfo;
+
+typedef struct
+{
+	char path[MAX_PATH];
+	int is_tracked;
+	time_t last_modified;
+} TrackedFile;
+
+/* pack layout: object data, then PackEntry[count] sorted by name and
+ * version, then the name table, then a PackTrailer; renames append a
+ * fresh index and trailer, leaving the old ones as dead space */
+typedef struct
+{
+	uint64_t offset;
+	uint64_t length;
+	uint64_t size;
+	uint64_t sum;
+	uint32_t name;
+	uint32_t version;
+	int32_t base;
+	uint32_t depth;
+} PackEntry;
+
+typedef struct
+{
+	PackEntry entry;
+	const char *name;
+	int old;
+} PackSlot;
+
+typedef struct
+{
+	uint64_t index;
+	uint64_t sum;
+	uint32_t count;
+	uint32_t names;
+	char magic[8];
+} PackTrailer;
+
+typedef struct
+{
+	char *map;
+	size_t size;
+	PackEntry *entries;
+	const char *names;
+	uint32_t count;
+	ino_t ino;
+	time_t mtime;
+} Pack;
+
+typedef struct
+{
+	const char *name;
+	int version;
+	int src;
+} PackItem;
+
+/* a snapshot names the root tree object; trees list "f <version> <name>"
+ * and "t <hash> <name>" lines and are stored in OBJECT_DIR by hash, so an
+ * unchanged directory is shared by every snapshot that contains it */
+typedef struct
+{
+	int id;
+	int files;
+	time_t timestamp;
+	uint64_t tree;
+	char username[MAX_PATH];
+} Snapshot;
+
+typedef struct
+{
+	const char *path;
+	int version;
+} TreeItem;
+
+/* MOVES_FILE holds "from\tto\tafter" lines in the order the moves were
+ * made, after being the newest snapshot at the time; the files of later
+ * snapshots already have the new name */
+typedef struct
+{
+	char *from;
+	char *to;
+	int after;
+} Move;
+
+typedef struct
+{
+	Move *list;
+	int count;
+} Moves;
+
+/* TIME_INDEX: a TimeHeader and one TimeEntry per history record, sorted by
+ * filename hash, then timestamp, so a file's version at any instant is a
+ * binary search away; rebuilt incrementally as history grows */
+typedef struct
+{
+	char magic[8];
+	uint64_t records;
+	uint64_t ino;
+} TimeHeader;
+
+typedef struct
+{
+	uint64_t key;
+	int64_t timestamp;
+	uint32_t record;
+	int32_t version;
+} TimeEntry;
+
+typedef struct
+{
+	TimeEntry *entries;
+	uint64_t count;
+} TimeIndex;
+
+/* SUMS_FILE: a SumsHeader, then one VersionSum per history record in the
+ * same order, holding the checksum of the record and of the version it
+ * names; zero where none was recorded */
+typedef struct
+{
+	char magic[8];
+	uint64_t ino;
+} SumsHeader;
+
+typedef struct
+{
+	uint64_t record;
+	uint64_t data;
+} VersionSum;
+
+/* what fsck found for one history record */
+typedef enum
+{
+	FSCK_OK,
+	FSCK_UNCHECKED,
+	FSCK_RECORD,
+	FSCK_CORRUPT,
+	FSCK_MISSING
+} FsckState;
+
+typedef struct
+{
+	const char *name;
+	int version;
+	uint64_t sum;
+} GrepItem;
+
+typedef struct
+{
+	uint64_t *keys;
+	size_t size;
+	size_t count;
+} HashSet;
+
+/* archive: ARCHIVE_MAGIC, then per file under VCS_DIR a section header,
+ * its relative name and its bytes; an "END" section carries the count */
+typedef struct
+{
+	char type[4];
+	uint32_t name_len;
+	uint64_t size;
+	uint64_t sum;
+} ArchiveSection;
+
+typedef enum
+{
+	WAL_HISTORY = 1,
+	WAL_TRACK,
+	WAL_UNTRACK,
+	WAL_SNAPSHOT,
+	WAL_COMMIT,
+	WAL_RENAME,
+	WAL_APPLIED
+} WalType;
+
+/* WAL_COMMIT carries the checksum of every record since the last commit;
+ * WAL_APPLIED carries the boot id under which everything before it was
+ * applied */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t type;
+	uint64_t len;
+	uint64_t sum;
+} WalRecord;
+
+/* records queued by this process, written out by wal_commit(), and the
+ * NUL-separated names of the files written for them */
+typedef struct
+{
+	char *buf;
+	size_t len;
+	size_t cap;
+	int records;
+	int rewrites;
+	char *files;
+	size_t files_len;
+	size_t files_cap;
+} Wal;
+
+typedef struct
+{
+	char **keys;
+	int *vals;
+	int size;
+	int count;
+} StrMap;
+
+/* in-memory index and version table, kept loaded by the daemon */
+typedef struct
+{
+	TrackedFile *files;
+	char *state;
+	int count;
+	StrMap paths;
+	StrMap versions;
+	off_t history_size;
+	off_t index_size;
+	ino_t index_ino;
+	struct timespec index_mtime;
+	int loaded;
+} Cache;
+
+/* retention rules read from CONFIG_FILE, 0 leaves a rule off */
+typedef struct
+{
+	int keep_last;
+	int keep_daily;
+	uint64_t max_bytes;
+} Retention;
+
+typedef struct
+{
+	const char *name;
+	int version;
+	uint32_t record;
+	time_t timestamp;
+	uint64_t bytes;
+	int packed;
+	int loose;
+	int drop;
+} PruneItem;
+
+typedef struct
+{
+	const char *from;
+	const char *to;
+	int score;
+} Rename;
+
+/* an untracked file that may be where a missing tracked file went */
+typedef struct
+{
+	const char *path;
+	off_t size;
+	uint64_t sum;
+	uint64_t *lines;
+	size_t nlines;
+	int taken;
+	int checked;
+} RenameCandidate;
+
+/* an open repository; commands run with the working directory at its root */
+struct EwRepo
+{
+	int dir;
+	int color;
+	int saved;
+	EwOutput output;
+	void *ctx;
+	Cache cache;
+};
+
+/* function declarations */
+static void *arena_alloc(size_t size);
+static void arena_init(void);
+static void arena_release(void);
+static EnhancedVersionInfo *new_record(void);
+static ArenaMark arena_mark(void);
+static void arena_reset(ArenaMark mark);
+static void out_of_memory(void);
+static uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+static ErrorCode read_blob(const char *path, Blob *blob);
+static ErrorCode write_blob(const char *path, const Blob *blob);
+static ErrorCode copy_file(const char *src, const char *dst);
+static ErrorCode split_lines(Blob *blob, FileContents *content);
+static ErrorCode load_version(const char *filename, int version, Blob *blob);
+static void make_parents(const char *path);
+static int pack_open(void);
+static int pack_find(const char *filename, int version);
+static ErrorCode pack_read(int i, Blob *blob);
+static ErrorCode gc(void);
+static ErrorCode pack_write(PackItem *items, int n, int *written, int *deltas);
+static void wal_append(WalType type, const void *data, size_t len);
+static void wal_file(const char *path);
+static ErrorCode wal_commit(void);
+static void wal_recover(void);
+static ErrorCode wal_drain(void);
+static int wal_pending_tracked(const char *path);
+static int wal_pending_version(const char *filename);
+static int index_remove(const char *path);
+static int lock_range(off_t start, short type);
+static int lock_store(short type);
+static int lock_version(const char *filename);
+static void unlock_versions(void);
+static void unlock_all(void);
+static ErrorCode snapshot(void);
+static void list_snapshots(void);
+static ErrorCode restore(int id);
+static int parse_time(const char *s, time_t *t);
+static ErrorCode time_index_load(TimeIndex *idx);
+static int version_at(TimeIndex *idx, const char *filename, time_t t);
+static ErrorCode revert_at(time_t t, char **paths, int npaths);
+static const char *find_substring(const char *hay, size_t n, const char *needle, size_t m);
+static int hashset_add(HashSet *set, uint64_t key);
+static int hashset_has(const HashSet *set, uint64_t key);
+static uint64_t parse_size(const char *s);
+static int retention_load(Retention *rules);
+static ErrorCode pin_tree(uint64_t hash, const char *prefix, const Moves *moves, int snap,
+						 HashSet *trees, HashSet *pins);
+static ErrorCode prune(int dry_run);
+static int snapshot_last(void);
+static ErrorCode moves_load(Moves *moves);
+static const char *move_follow(const Moves *moves, const char *name, int snap);
+static ErrorCode pack_rename(const char **from, const char **to, int n);
+static ErrorCode rename_apply(const char **from, const char **to, int n);
+static ErrorCode mv_record(const char *from, const char *to);
+static ErrorCode mv(const char *from, const char *to);
+static int detect_renames(Rename **renames);
+static ErrorCode save_all(void);
+static ErrorCode grep(const char *pattern, int extended, const char *filename);
+static int sums_current(void);
+static VersionSum *sums_load(uint64_t n);
+static ErrorCode fsck(int quarantine);
+static int transfer(int in, off_t *in_off, int out, uint64_t len);
+static ErrorCode export_repo(const char *target);
+static ErrorCode import_repo(const char *source);
+static unsigned int hash_string(const char *s);
+static int *strmap_get(StrMap *map, const char *key);
+static void strmap_put(StrMap *map, char *key, int val);
+static void strmap_clear(StrMap *map, int free_keys);
+static void cache_load(void);
+static void cache_free(void);
+static void cache_refresh(int i);
+static void cache_catch_up(void);
+static int latest_version(const char *filename);
+static void daemon_run(int autosave);
+static int daemon_request(int argc, char *argv[]);
+static void print_error(ErrorCode result, const char *command);
+static Command parse_command(const char *name);
+static void cache_sync(int refresh);
+static void say(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void emit(const char *text, size_t len);
+static int enter(EwRepo *r);
+static void leave(int cwd);
+static ErrorCode run(EwRepo *r, Command cmd, int argc, char *argv[]);
+static ErrorCode diff_script(FileContents *old_content, FileContents *new_content, DiffScript *d);
+static ErrorCode compute_changes(FileContents *old_content, FileContents *new_content, EnhancedVersionInfo *info);
+static void create_directory(const char *path);
+static ErrorCode diff(const char *filename);
+static ErrorCode diff_files(const char *file1, FileContents *old_content, const char *file2, FileContents *new_content);
+static int file_exists(const char *filename);
+static ErrorCode history(void);
+static void init(void);
+static int is_tracked(const char *filepath);
+static ErrorCode track(const char *filepath);
+static ErrorCode untrack(const char *filepath);
+static void status(void);
+static void status_renames(void);
+static void find_files(const char *path);
+static void list_versions(const char *filename);
+static ErrorCode revert(const char *filename, int target_version);
+static ErrorCode save(const char *filename);
+static char *get_username(void);
+static ErrorCode handle_command(Command cmd, int argc, char *argv[]);
+static ErrorCode read_file(const char *filename, FileContents *content);
+
+/* globals */
+static Arena arena;
+static EwRepo *repo;
+static Pack pack;
+static Wal wal;
+static int lock_fd = -1;
+static volatile sig_atomic_t daemon_stop;
+static int daemon_serving;
+
+
+ErrorCode
+handle_command(Command cmd, int argc, char *argv[])
+{
+	ErrorCode result;
+
+	switch (cmd)
+	{
+	case CMD_INIT:
+		init();
+		return SUCCESS;
+
+	case CMD_DIFF:
+		CHECK_ARGS(3);
+		CHECK_FILE(argv[2]);
+		CHECK_REPO();
+		return diff(argv[2]);
+	
+	case CMD_FIND:
+		CHECK_REPO();
+		find_files(".");
+		return SUCCESS;
+
+	case CMD_SAVE:
+		CHECK_ARGS(3);
+		CHECK_REPO();
+		if (strcmp(argv[2], "--all-modified") == 0)
+			return save_all();
+		for (int i = 2; i < argc; i++)
+		{
+			CHECK_FILE(argv[i]);
+			CHECK_TRACKED(argv[i]);
+		}
+		for (int i = 2; i < argc; i++)
+		{
+			ArenaMark mark = arena_mark();
+
+			result = save(argv[i]);
+			arena_reset(mark);
+			if (result != SUCCESS)
+				return result;
+		}
+		return SUCCESS;
+
+	case CMD_REVERT:
+		CHECK_ARGS(4);
+		CHECK_REPO();
+		if (strcmp(argv[2], "--at") == 0)
+		{
+			time_t t;
+
+			CHECK_HISTORY();
+			if (parse_time(argv[3], &t) != 0)
+				return ERR_INVALID_TIME;
+			return revert_at(t, argv + 4, argc - 4);
+		}
+		CHECK_FILE(argv[2]);
+		CHECK_REPO();
+		CHECK_TRACKED(argv[2]);
+		return revert(argv[2], atoi(argv[3]));
+
+	case CMD_HISTORY:
+		CHECK_REPO();
+		CHECK_HISTORY();
+		return history();
+
+	case CMD_STATUS:
+		CHECK_REPO();
+		status();
+		return SUCCESS;
+
+	case CMD_TRACK:
+		CHECK_ARGS(3);
+		CHECK_FILE(argv[2]);
+		CHECK_REPO();
+		return track(argv[2]);
+
+	case CMD_UNTRACK:
+		CHECK_ARGS(3);
+		CHECK_FILE(argv[2]);
+		CHECK_REPO();
+		CHECK_TRACKED(argv[2]);
+		return untrack(argv[2]);
+
+	case CMD_DAEMON:
+		CHECK_REPO();
+		daemon_run(argc > 2 && strcmp(argv[2], "--autosave") == 0);
+		return SUCCESS;
+
+	case CMD_GC:
+		CHECK_REPO();
+		CHECK_HISTORY();
+		return gc();
+
+	case CMD_SNAPSHOT:
+		CHECK_REPO();
+		CHECK_HISTORY();
+		if (argc > 2 && strcmp(argv[2], "list") == 0)
+		{
+			list_snapshots();
+			return SUCCESS;
+		}
+		return snapshot();
+
+	case CMD_GREP:
+		CHECK_ARGS(3);
+		CHECK_REPO();
+		CHECK_HISTORY();
+		if (strcmp(argv[2], "-E") == 0)
+		{
+			CHECK_ARGS(4);
+			return grep(argv[3], 1, argc > 4 ? argv[4] : NULL);
+		}
+		return grep(argv[2], 0, argc > 3 ? argv[3] : NULL);
+
+	case CMD_MV:
+		CHECK_ARGS(4);
+		CHECK_REPO();
+		CHECK_TRACKED(argv[2]);
+		return mv(argv[2], argv[3]);
+
+	case CMD_FSCK:
+		CHECK_REPO();
+		CHECK_HISTORY();
+		return fsck(argc > 2 && strcmp(argv[2], "--quarantine") == 0);
+
+	case CMD_PRUNE:
+		CHECK_REPO();
+		CHECK_HISTORY();
+		return prune(argc > 2 && strcmp(argv[2], "-n") == 0);
+
+	case CMD_EXPORT:
+		CHECK_REPO();
+		return export_repo(argc > 2 ? argv[2] : "-");
+
+	case CMD_IMPORT:
+		return import_repo(argc > 2 ? argv[2] : "-");
+
+	case CMD_RESTORE:
+		CHECK_ARGS(3);
+		CHECK_REPO();
+		if (atoi(argv[2]) < 1)
+			return ERR_INVALID_VERSION;
+		return restore(atoi(argv[2]));
+
+	default:
+		return ERR_UNKNOWN_COMMAND;
+	}
+}
+
+int 
+is_tracked(const char *filepath)
+{
+	TrackedFile file;
+	int *i, pending;
+
+	if ((pending = wal_pending_tracked(filepath)) >= 0)
+		return pending;
+
+	if (repo->cache.loaded)
+		return (i = strmap_get(&repo->cache.paths, filepath)) && repo->cache.files[*i].is_tracked;
+
+	FILE *index = fopen(INDEX_FILE, "rb");
+	if (!index)
+		return 0;
+
+	while (fread(&file, sizeof(TrackedFile), 1, index) == 1)
+	{
+		if (strcmp(file.path, filepath) == 0 && file.is_tracked)
+		{
+			fclose(index);
+			return 1;
+		}
+	}
+	fclose(index);
+	return 0;
+}
+
+ErrorCode
+track(const char *filepath)
+{
+	TrackedFile file = {0};
+	struct stat st;
+
+	if (stat(filepath, &st) != 0)
+		return ERR_NO_FILE;
+
+	if (S_ISDIR(st.st_mode))
+	{
+		say("%sCannot track directory: %s%s\n", RED, filepath, RESET);
+		return ERR_NO_FILE;
+	}
+
+	if (is_tracked(filepath))
+	{
+		say("%sAlready tracking: %s%s\n", YELLOW, filepath, RESET);
+		return SUCCESS;
+	}
+
+	strncpy(file.path, filepath, MAX_PATH - 1);
+	file.is_tracked = 1;
+	file.last_modified = st.st_mtime;
+
+	wal_append(WAL_TRACK, &file, sizeof(TrackedFile));
+
+	say("%sNow tracking: %s%s\n", GREEN, filepath, RESET);
+
+	if (access(VCS_DIR, F_OK) == 0)
+		return save(filepath);
+	return SUCCESS;
+}
+
+ErrorCode
+untrack(const char *filepath)
+{
+	if (!is_tracked(filepath))
+		return ERR_FILE_NOT_TRACKED;
+
+	wal_append(WAL_UNTRACK, filepath, strlen(filepath) + 1);
+	say("%sNo longer tracking: %s%s\n", GREEN, filepath, RESET);
+	return SUCCESS;
+}
+
+void
+status(void)
+{
+	TrackedFile file;
+	struct stat st;
+	FILE *index;
+	int i;
+
+	if (repo->cache.loaded)
+	{
+		say("%sTracked files: %s\n", YELLOW, RESET);
+		for (i = 0; i < repo->cache.count; i++)
+		{
+			if (!repo->cache.files[i].is_tracked)
+				continue;
+			if (repo->cache.state[i] == 'M')
+				say(" %s%s (modified)%s\n", RED, repo->cache.files[i].path, RESET);
+			else if (repo->cache.state[i] == 'D')
+				say(" %s%s (deleted)%s\n", RED, repo->cache.files[i].path, RESET);
+			else
+				say(" %s%s%s\n", GREEN, repo->cache.files[i].path, RESET);
+		}
+		/* the daemon answers from memory; walking the tree would undo that */
+		if (!daemon_serving)
+			status_renames();
+		return;
+	}
+
+	index = fopen(INDEX_FILE, "rb");
+	if (!index)
+	{
+		say("%sNo tracked files%s\n", YELLOW, RESET);
+		return;
+	}
+
+	say("%sTracked files: %s\n", YELLOW, RESET);
+	while (fread(&file, sizeof(TrackedFile), 1, index) == 1)
+	{
+		if (file.is_tracked)
+		{
+			if (stat(file.path, &st) == 0)
+			{
+				if (st.st_mtime > file.last_modified)
+				{
+					say(" %s%s (modified)%s\n", RED, file.path, RESET);
+				}
+				else
+				{
+					say(" %s%s%s\n", GREEN, file.path, RESET);
+				}
+			}
+			else
+			{
+				say(" %s%s (deleted)%s\n", RED, file.path, RESET);
+			}
+		}
+	}
+	fclose(index);
+	status_renames();
+}
+
+void 
+find_files(const char *path)
+{
+
+	DIR *dir;
+	struct dirent *entry;
+	char full_path[MAX_PATH];
+
+	dir = opendir(path);
+	if (!dir)
+	{
+		say("%sError opening directory: %s%s\n", RED, path, RESET);
+		return;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		/* skip . , .. and .svcs dir */
+		if (strcmp(entry->d_name, ".") == 0 ||
+			strcmp(entry->d_name, "..") == 0 ||
+			strcmp(entry->d_name, ".svcs") == 0)
+		{
+			continue;
+		}
+
+		if (strcmp(path, ".") == 0)
+		{
+			snprintf(full_path, sizeof(full_path), "%s", entry->d_name);
+		}
+		else
+		{
+			snprintf(full_path, sizeof(full_path), "%s%s", path, entry->d_name);
+		}
+
+		struct stat path_stat;
+		if (stat(full_path, &path_stat) == 0)
+		{
+			if (S_ISDIR(path_stat.st_mode))
+			{
+				find_files(full_path);
+			}
+			else if (S_ISREG(path_stat.st_mode))
+			{
+				if (is_tracked(full_path))
+				{
+					say(" %s%s%s\n", GREEN, full_path, RESET);
+				}
+				else
+				{
+					say(" %s%s (untracked)%s\n", YELLOW, full_path, RESET);
+				}
+			}
+		}
+	}
+	closedir(dir);
+}
+
+ErrorCode
+diff_files(const char *file1, FileContents *old_content, const char *file2, FileContents *new_content)
+{
+    const int M = old_content->line_count;
+    const int N = new_content->line_count;
+    DiffScript d;
+
+    if (diff_script(old_content, new_content, &d) != SUCCESS) {
+        out_of_memory();
+        return ERR_NO_MEMORY;
+    }
+    
+    say("%s--- %s%s\n", RED, file1, RESET);
+    say("%s+++ %s%s\n", GREEN, file2, RESET);
+    
+    const int CONTEXT = 3;
+    const int change_count = d.count;
+    const char *change_type = d.types;
+    char **changed_lines = d.lines;
+    
+    if (change_count > 0) {
+        int old_lines = 0;
+        int new_lines = 0;
+        for (int k = 0; k < change_count; k++) {
+            if (change_type[k] == '-' || change_type[k] == ' ') old_lines++;
+            if (change_type[k] == '+' || change_type[k] == ' ') new_lines++;
+        }
+        
+        say("%s@@ -%d,%d +%d,%d @@%s\n", 
+               CYAN,
+               (M > CONTEXT ? M - CONTEXT : 1), old_lines,
+               (N > CONTEXT ? N - CONTEXT : 1), new_lines,
+               RESET);
+        
+        for (int k = 0; k < change_count; k++) {
+            switch (change_type[k]) {
+                case '+':
+                    say("%s+%s%s\n", GREEN, changed_lines[k], RESET);
+                    break;
+                case '-':
+                    say("%s-%s%s\n", RED, changed_lines[k], RESET);
+                    break;
+                case ' ':
+                    say(" %s\n", changed_lines[k]);
+                    break;
+            }
+        }
+        say("\n");
+    }
+    return SUCCESS;
+}
+
+void
+arena_init(void)
+{
+	char *limit = getenv("EW_MEMORY_LIMIT");
+	uint64_t n;
+
+	arena.head = NULL;
+	arena.total = 0;
+	arena.limit = ARENA_LIMIT;
+
+	if (!limit || !*limit)
+		return;
+
+	n = parse_size(limit);
+	if (n > 0)
+		arena.limit = n;
+}
+
+/* a byte count with an optional K, M or G suffix */
+uint64_t
+parse_size(const char *s)
+{
+	char *end;
+	uint64_t n = strtoull(s, &end, 10);
+
+	switch (*end)
+	{
+	case 'G': case 'g': n <<= 10; /* fallthrough */
+	case 'M': case 'm': n <<= 10; /* fallthrough */
+	case 'K': case 'k': n <<= 10; break;
+	}
+	return n;
+}
+
+/* bump allocator backing all per-command buffers; NULL once the limit is hit */
+void *
+arena_alloc(size_t size)
+{
+	ArenaBlock *block = arena.head;
+	size_t want;
+	void *p;
+
+	size = (size + 15) & ~(size_t)15;
+	if (!block || block->size - block->used < size)
+	{
+		want = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+		if (arena.total + want > arena.limit)
+		{
+			if (arena.total + size > arena.limit)
+				return NULL;
+			want = size;
+		}
+
+		block = malloc(sizeof(ArenaBlock) + want);
+		if (!block)
+			return NULL;
+		block->next = arena.head;
+		block->used = 0;
+		block->size = want;
+		arena.head = block;
+		arena.total += want;
+	}
+
+	p = block->data + block->used;
+	block->used += size;
+	return p;
+}
+
+void
+arena_release(void)
+{
+	ArenaBlock *block, *next;
+
+	for (block = arena.head; block; block = next)
+	{
+		next = block->next;
+		free(block);
+	}
+	arena.head = NULL;
+	arena.total = 0;
+}
+
+ArenaMark
+arena_mark(void)
+{
+	ArenaMark mark = { arena.head, arena.head ? arena.head->used : 0, arena.total };
+	return mark;
+}
+
+/* frees everything allocated since mark */
+void
+arena_reset(ArenaMark mark)
+{
+	ArenaBlock *next;
+
+	while (arena.head && arena.head != mark.block)
+	{
+		next = arena.head->next;
+		free(arena.head);
+		arena.head = next;
+	}
+	if (arena.head)
+		arena.head->used = mark.used;
+	arena.total = mark.total;
+}
+
+void
+out_of_memory(void)
+{
+	say("%sInput too large: memory limit of %zu bytes exceeded "
+		   "(raise EW_MEMORY_LIMIT)%s\n", RED, arena.limit, RESET);
+}
+
+EnhancedVersionInfo *
+new_record(void)
+{
+	EnhancedVersionInfo *info = arena_alloc(sizeof(EnhancedVersionInfo));
+
+	if (info)
+		memset(info, 0, sizeof(EnhancedVersionInfo));
+	return info;
+}
+
+int
+file_exists(const char *filename)
+{
+	return access(filename, F_OK) == 0;
+}
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_P2;
+	acc = ROTL64(acc, 31);
+	return acc * XXH_P1;
+}
+
+static uint64_t
+xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+/* XXH64: four independent lanes over 32-byte stripes */
+uint64_t
+xxh64(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data, *end = p + len;
+	uint64_t h, v[4], k;
+	uint32_t w;
+
+	if (len >= 32)
+	{
+		v[0] = seed + XXH_P1 + XXH_P2;
+		v[1] = seed + XXH_P2;
+		v[2] = seed;
+		v[3] = seed - XXH_P1;
+		do
+		{
+			for (int i = 0; i < 4; i++, p += 8)
+			{
+				memcpy(&k, p, 8);
+				v[i] = xxh64_round(v[i], k);
+			}
+		} while (p <= end - 32);
+		h = ROTL64(v[0], 1) + ROTL64(v[1], 7) + ROTL64(v[2], 12) + ROTL64(v[3], 18);
+		for (int i = 0; i < 4; i++)
+			h = xxh64_merge(h, v[i]);
+	}
+	else
+	{
+		h = seed + XXH_P5;
+	}
+
+	h += len;
+	for (; p + 8 <= end; p += 8)
+	{
+		memcpy(&k, p, 8);
+		h ^= xxh64_round(0, k);
+		h = ROTL64(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if (p + 4 <= end)
+	{
+		memcpy(&w, p, 4);
+		h ^= (uint64_t)w * XXH_P1;
+		h = ROTL64(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++)
+	{
+		h ^= *p * XXH_P5;
+		h = ROTL64(h, 11) * XXH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+/* reads a whole file into the arena, NUL-terminated */
+ErrorCode
+read_blob(const char *path, Blob *blob)
+{
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	blob->data = NULL;
+	blob->len = 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return ERR_NO_FILE;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return ERR_IO;
+	}
+	if (!(blob->data = arena_alloc(st.st_size + 1)))
+	{
+		close(fd);
+		return ERR_NO_MEMORY;
+	}
+	while (blob->len < (size_t)st.st_size &&
+		   (n = read(fd, blob->data + blob->len, st.st_size - blob->len)) > 0)
+		blob->len += n;
+	close(fd);
+	blob->data[blob->len] = '\0';
+	/* a short read would store a truncated copy */
+	return blob->len == (size_t)st.st_size ? SUCCESS : ERR_IO;
+}
+
+void
+make_parents(const char *path)
+{
+	char dir[MAX_PATH * 2];
+	char *p;
+
+	strncpy(dir, path, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = '\0';
+	for (p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/'))
+	{
+		*p = '\0';
+		create_directory(dir);
+		*p = '/';
+	}
+}
+
+ErrorCode
+write_blob(const char *path, const Blob *blob)
+{
+	size_t off = 0;
+	ssize_t n;
+	int fd;
+
+	make_parents(path);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return ERR_IO;
+	while (off < blob->len && (n = write(fd, blob->data + off, blob->len - off)) > 0)
+		off += n;
+	if (close(fd) != 0 || off < blob->len)
+		return ERR_IO;
+	return SUCCESS;
+}
+
+ErrorCode
+copy_file(const char *src, const char *dst)
+{
+	ArenaMark mark = arena_mark();
+	ErrorCode result;
+	Blob blob;
+
+	if ((result = read_blob(src, &blob)) == SUCCESS)
+		result = write_blob(dst, &blob);
+	arena_reset(mark);
+	return result;
+}
+
+/* splits blob into lines in place */
+ErrorCode
+split_lines(Blob *blob, FileContents *content)
+{
+	char *p, *end = blob->data + blob->len;
+	int n = 0;
+
+	content->lines = NULL;
+	content->line_count = 0;
+
+	for (p = blob->data; p < end; p++)
+		if (*p == '\n')
+			n++;
+	if (blob->len > 0 && end[-1] != '\n')
+		n++;
+
+	if (!(content->lines = arena_alloc((n + 1) * sizeof(char *))))
+		return ERR_NO_MEMORY;
+
+	for (p = blob->data; p < end; )
+	{
+		char *newline = memchr(p, '\n', end - p);
+		content->lines[content->line_count++] = p;
+		if (!newline)
+			break;
+		*newline = '\0';
+		p = newline + 1;
+	}
+	return SUCCESS;
+}
+
+/* a missing file reads as empty */
+ErrorCode
+read_file(const char *filename, FileContents *content)
+{
+	Blob blob;
+
+	if (read_blob(filename, &blob) == ERR_NO_MEMORY)
+		return ERR_NO_MEMORY;
+	return split_lines(&blob, content);
+}
+
+/* whether a trailer ending at end, and the index before it, check out */
+static int
+pack_trailer_at(size_t end, PackTrailer *trailer)
+{
+	if (end < sizeof(PackTrailer))
+		return 0;
+	memcpy(trailer, pack.map + end - sizeof(PackTrailer), sizeof(PackTrailer));
+	return memcmp(trailer->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) == 0 &&
+		trailer->index < end && trailer->index % __alignof__(PackEntry) == 0 &&
+		trailer->count < end / sizeof(PackEntry) &&
+		trailer->index + (uint64_t)trailer->count * sizeof(PackEntry) + trailer->names +
+		sizeof(PackTrailer) == end &&
+		xxh64(pack.map + trailer->index, end - trailer->index - sizeof(PackTrailer), 0) ==
+		trailer->sum;
+}
+
+/* (re)maps the pack if it changed on disk; 0 when a pack is available */
+int
+pack_open(void)
+{
+	PackTrailer trailer;
+	struct stat st;
+	size_t end;
+	int fd;
+
+	if (stat(PACK_FILE, &st) != 0)
+	{
+		if (pack.map)
+			munmap(pack.map, pack.size);
+		memset(&pack, 0, sizeof(Pack));
+		return -1;
+	}
+	if (pack.map && pack.ino == st.st_ino && pack.mtime == st.st_mtime &&
+		pack.size == (size_t)st.st_size)
+		return 0;
+
+	if (pack.map)
+		munmap(pack.map, pack.size);
+	memset(&pack, 0, sizeof(Pack));
+
+	if ((size_t)st.st_size < sizeof(PackTrailer) || (fd = open(PACK_FILE, O_RDONLY)) < 0)
+		return -1;
+	pack.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pack.map == MAP_FAILED)
+	{
+		pack.map = NULL;
+		return -1;
+	}
+	pack.size = st.st_size;
+	pack.ino = st.st_ino;
+	pack.mtime = st.st_mtime;
+
+	/* renames append a new index, and one torn by a crash leaves the
+	 * trailer before it intact: fall back to wherever the magic ends */
+	for (end = pack.size; !pack_trailer_at(end, &trailer);)
+	{
+		const char *magic = end > sizeof(PACK_MAGIC) ?
+			memrchr(pack.map, PACK_MAGIC[0], end - sizeof(PACK_MAGIC)) : NULL;
+
+		if (!magic)
+		{
+			say("%sIgnoring corrupt pack %s%s\n", RED, PACK_FILE, RESET);
+			munmap(pack.map, pack.size);
+			memset(&pack, 0, sizeof(Pack));
+			return -1;
+		}
+		end = magic - pack.map + sizeof(PACK_MAGIC);
+	}
+
+	pack.entries = (PackEntry *)(pack.map + trailer.index);
+	pack.names = pack.map + trailer.index + (uint64_t)trailer.count * sizeof(PackEntry);
+	pack.count = trailer.count;
+	return 0;
+}
+
+int
+pack_find(const char *filename, int version)
+{
+	int lo = 0, hi, mid, cmp;
+
+	if (pack_open() != 0)
+		return -1;
+
+	hi = (int)pack.count - 1;
+	while (lo <= hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		cmp = strcmp(pack.names + pack.entries[mid].name, filename);
+		if (cmp == 0)
+			cmp = (int)pack.entries[mid].version - version;
+		if (cmp == 0)
+			return mid;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return -1;
+}
+
+/* inflates entry i, following its delta chain, into the arena */
+ErrorCode
+pack_read(int i, Blob *blob)
+{
+	PackEntry *e = &pack.entries[i];
+	const char *data = pack.map + e->offset;
+	uint64_t prefix, suffix;
+	ErrorCode result;
+	Blob base;
+
+	if (!(blob->data = arena_alloc(e->size + 1)))
+		return ERR_NO_MEMORY;
+	blob->len = e->size;
+
+	if (e->base < 0)
+	{
+		memcpy(blob->data, data, e->size);
+	}
+	else
+	{
+		/* delta: common prefix and suffix with the base, then the middle */
+		if ((uint32_t)e->base >= pack.count || (result = pack_read(e->base, &base)) != SUCCESS)
+			return ERR_IO;
+		memcpy(&prefix, data, 8);
+		memcpy(&suffix, data + 8, 8);
+		if (prefix + suffix > base.len || prefix + suffix + e->length - 16 != e->size)
+			return ERR_IO;
+		memcpy(blob->data, base.data, prefix);
+		memcpy(blob->data + prefix, data + 16, e->length - 16);
+		memcpy(blob->data + e->size - suffix, base.data + base.len - suffix, suffix);
+	}
+	blob->data[blob->len] = '\0';
+
+	if (xxh64(blob->data, blob->len, 0) != e->sum)
+		return ERR_IO;
+	return SUCCESS;
+}
+
+/* fetches a stored version from the loose files or the pack */
+ErrorCode
+load_version(const char *filename, int version, Blob *blob)
+{
+	char path[MAX_PATH * 2];
+	ErrorCode result;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/%s.%d", BACKUP_DIR, filename, version);
+	if ((result = read_blob(path, blob)) != ERR_NO_FILE)
+		return result;
+	if ((i = pack_find(filename, version)) >= 0)
+		return pack_read(i, blob);
+	return ERR_INVALID_VERSION;
+}
+
+static int
+line_eq(const DiffScript *d, int i, int j)
+{
+	return d->ha[i] == d->hb[j] && strcmp(d->a[i], d->b[j]) == 0;
+}
+
+static void
+script_add(DiffScript *d, char type, char *line)
+{
+	d->types[d->count] = type;
+	d->lines[d->count++] = line;
+}
+
+/* LCS lengths of a[a0..a0+m) against each prefix of b[b0..b0+n), or with
+ * dir < 0 of both run backwards, so against each suffix; one row of ints */
+static void
+lcs_row(const DiffScript *d, int a0, int m, int b0, int n, int dir, int *row)
+{
+	int i, j, ai, diag, up;
+
+	memset(row, 0, (n + 1) * sizeof(int));
+	for (i = 0; i < m; i++)
+	{
+		ai = dir > 0 ? a0 + i : a0 + m - 1 - i;
+		for (diag = 0, j = 1; j <= n; j++)
+		{
+			up = row[j];
+			if (line_eq(d, ai, dir > 0 ? b0 + j - 1 : b0 + n - j))
+				row[j] = diag + 1;
+			else if (row[j - 1] > up)
+				row[j] = row[j - 1];
+			diag = up;
+		}
+	}
+}
+
+/* Hirschberg: split a in half, find where b splits along an optimal path
+ * from one forward and one backward LCS row, and recurse on both halves */
+static void
+diff_split(DiffScript *d, int a0, int m, int b0, int n)
+{
+	int i, j, k, best, mid, tail = 0;
+
+	/* common ends cost nothing */
+	for (; m > 0 && n > 0 && line_eq(d, a0, b0); a0++, b0++, m--, n--)
+		script_add(d, ' ', d->a[a0]);
+	for (; m > 0 && n > 0 && line_eq(d, a0 + m - 1, b0 + n - 1); m--, n--)
+		tail++;
+
+	if (m == 0)
+	{
+		for (j = 0; j < n; j++)
+			script_add(d, '+', d->b[b0 + j]);
+	}
+	else if (n == 0)
+	{
+		for (i = 0; i < m; i++)
+			script_add(d, '-', d->a[a0 + i]);
+	}
+	else if (m == 1)
+	{
+		for (k = 0; k < n && !line_eq(d, a0, b0 + k); k++)
+			;
+		if (k == n)
+			script_add(d, '-', d->a[a0]);
+		for (j = 0; j < n; j++)
+			script_add(d, j == k ? ' ' : '+', d->b[b0 + j]);
+	}
+	else
+	{
+		mid = m / 2;
+		lcs_row(d, a0, mid, b0, n, 1, d->fwd);
+		lcs_row(d, a0 + mid, m - mid, b0, n, -1, d->rev);
+		for (k = 0, best = -1, j = 0; j <= n; j++)
+		{
+			if (d->fwd[j] + d->rev[n - j] > best)
+			{
+				best = d->fwd[j] + d->rev[n - j];
+				k = j;
+			}
+		}
+		diff_split(d, a0, mid, b0, k);
+		diff_split(d, a0 + mid, m - mid, b0 + k, n - k);
+	}
+
+	for (i = 0; i < tail; i++)
+		script_add(d, ' ', d->a[a0 + m + i]);
+}
+
+/* the edit script from old_content to new_content in file order, in space
+ * linear in the number of lines */
+ErrorCode
+diff_script(FileContents *old_content, FileContents *new_content, DiffScript *d)
+{
+	int m = old_content->line_count, n = new_content->line_count, i;
+
+	d->a = old_content->lines;
+	d->b = new_content->lines;
+	d->count = 0;
+	d->ha = arena_alloc((m + 1) * sizeof(uint64_t));
+	d->hb = arena_alloc((n + 1) * sizeof(uint64_t));
+	d->fwd = arena_alloc((n + 1) * sizeof(int));
+	d->rev = arena_alloc((n + 1) * sizeof(int));
+	d->types = arena_alloc(m + n + 1);
+	d->lines = arena_alloc((m + n + 1) * sizeof(char *));
+	if (!d->ha || !d->hb || !d->fwd || !d->rev || !d->types || !d->lines)
+		return ERR_NO_MEMORY;
+
+	for (i = 0; i < m; i++)
+		d->ha[i] = xxh64(d->a[i], strlen(d->a[i]), 0);
+	for (i = 0; i < n; i++)
+		d->hb[i] = xxh64(d->b[i], strlen(d->b[i]), 0);
+	diff_split(d, 0, m, 0, n);
+	return SUCCESS;
+}
+
+/* changed lines are recorded last first, as history has always listed them */
+ErrorCode
+compute_changes(FileContents *old_content, FileContents *new_content, EnhancedVersionInfo *info)
+{
+	DiffScript d;
+	int k;
+
+	info->lines_added = 0;
+	info->lines_removed = 0;
+	info->num_changes = 0;
+
+	if (diff_script(old_content, new_content, &d) != SUCCESS)
+		return ERR_NO_MEMORY;
+
+	for (k = d.count - 1; k >= 0; k--)
+	{
+		if (d.types[k] == ' ')
+			continue;
+		if (info->num_changes < MAX_LINES)
+		{
+			strncpy(info->changed_lines[info->num_changes], d.lines[k], MAX_LINE_LENGTH - 1);
+			info->change_types[info->num_changes++] = d.types[k];
+		}
+		if (d.types[k] == '+')
+			info->lines_added++;
+		else
+			info->lines_removed++;
+	}
+	return SUCCESS;
+}
+
+void 
+create_directory(const char *path)
+{
+#ifdef _WIN32
+	_mkdir(path);
+#else
+	mkdir(path, 0755);
+#endif
+}
+
+char *
+get_username(void)
+{
+	char *username = getenv("USER");
+	if (!username)
+		username = getenv("USERNAME"); 
+	return username ? username : "unknown";
+}
+
+void 
+init(void)
+{
+	if (access(VCS_DIR, F_OK) == 0)
+	{
+		say("%sRepository already exists!%s\n", YELLOW, RESET);
+		return;
+	}
+
+	create_directory(VCS_DIR);
+	create_directory(BACKUP_DIR);
+
+	FILE *history = fopen(HISTORY_FILE, "w");
+	if (!history)
+	{
+		say("%sError creating history file%s\n", RED, RESET);
+		return;
+	}
+	fclose(history);
+
+	DIR *dir = opendir(".");
+	struct dirent *entry;
+
+	if (dir != NULL)
+	{
+		int files_added = 0;
+		while ((entry = readdir(dir)) != NULL)
+		{
+			if (strcmp(entry->d_name, ".") == 0 ||
+				strcmp(entry->d_name, "..") == 0 ||
+				strcmp(entry->d_name, ".svcs") == 0)
+			{
+				continue;
+			}
+
+			struct stat path_stat;
+			stat(entry->d_name, &path_stat);
+
+			if (!S_ISREG(path_stat.st_mode))
+			{
+				continue;
+			}
+
+			ArenaMark mark = arena_mark();
+			EnhancedVersionInfo *info = new_record();
+			if (!info)
+			{
+				out_of_memory();
+				break;
+			}
+
+			char backup_path[MAX_PATH * 2];
+			snprintf(backup_path, sizeof(backup_path), "%s/%s.1", BACKUP_DIR,
+					 entry->d_name);
+
+			copy_file(entry->d_name, backup_path);
+			wal_file(backup_path);
+
+			strncpy(info->filename, entry->d_name, MAX_PATH - 1);
+			strncpy(info->username, getenv("USER") ? getenv("USER") : "unknown",
+					MAX_PATH - 1);
+			info->timestamp = time(NULL);
+			info->version = 1;
+
+			wal_append(WAL_HISTORY, info, sizeof(EnhancedVersionInfo));
+			arena_reset(mark);
+			say(" %s+ %s%s\n", GREEN, entry->d_name, RESET);
+			files_added++;
+		}
+
+		if (files_added == 0)
+		{
+			say("%sInitialized empty repository%s\n", GREEN, RESET);
+		}
+		else
+		{
+			say("%sInitialized repository with %d files%s\n", GREEN, files_added, RESET);
+		}
+	}
+	closedir(dir);
+}
+
+ErrorCode
+save(const char *filename)
+{
+	char latest_path[MAX_PATH * 2];
+	FileContents old_content, new_content;
+	Blob blob, prev;
+	ErrorCode result;
+	int latest;
+
+	if (!is_tracked(filename))
+		return ERR_FILE_NOT_TRACKED;
+
+	if (access(filename, F_OK) != 0)
+		return ERR_NO_FILE;
+
+	if (lock_store(F_RDLCK) != 0 || lock_version(filename) != 0)
+		return ERR_IO;
+
+	if ((latest = latest_version(filename)) < 0)
+		return latest;
+
+	latest++;
+
+	snprintf(latest_path, sizeof(latest_path), "%s/%s.%d", BACKUP_DIR, filename, latest);
+	EnhancedVersionInfo *new_info = new_record();
+	if (!new_info)
+	{
+		out_of_memory();
+		return ERR_NO_MEMORY;
+	}
+	if ((result = read_blob(filename, &blob)) != SUCCESS)
+	{
+		if (result == ERR_NO_MEMORY)
+			out_of_memory();
+		else
+			say("%sCannot read %s%s\n", RED, filename, RESET);
+		return result;
+	}
+	if (write_blob(latest_path, &blob) != SUCCESS)
+	{
+		say("%sError writing %s%s\n", RED, latest_path, RESET);
+		return ERR_IO;
+	}
+	strncpy(new_info->filename, filename, MAX_PATH - 1);
+	strncpy(new_info->username, getenv("USER") ? getenv("USER") : "unknown", MAX_PATH - 1);
+	new_info->timestamp = time(NULL);
+	new_info->version = latest;
+
+	result = load_version(filename, latest - 1, &prev);
+	if (result == ERR_NO_MEMORY || split_lines(&prev, &old_content) != SUCCESS ||
+		split_lines(&blob, &new_content) != SUCCESS ||
+		compute_changes(&old_content, &new_content, new_info) != SUCCESS)
+	{
+		unlink(latest_path);
+		out_of_memory();
+		return ERR_NO_MEMORY;
+	}
+
+	wal_file(latest_path);
+	wal_append(WAL_HISTORY, new_info, sizeof(EnhancedVersionInfo));
+	if (repo->cache.loaded)
+	{
+		int *slot = strmap_get(&repo->cache.versions, filename);
+		if (slot)
+			*slot = latest;
+		else
+			strmap_put(&repo->cache.versions, strdup(filename), latest);
+	}
+	repo->saved = latest;
+	say("%sSaved version %d of %s%s\n", GREEN, latest, filename, RESET);
+	return SUCCESS;
+}
+
+ErrorCode
+diff(const char *filename)
+{
+	char latest_path[MAX_PATH * 2];
+	FileContents old_content, new_content;
+	ErrorCode result;
+	Blob blob;
+	int latest;
+
+	if (lock_store(F_RDLCK) != 0)
+		return ERR_IO;
+	if ((latest = latest_version(filename)) < 0)
+		return latest;
+
+	if (latest < 1)
+	{
+		say("%sNo versions found for %s%s\n", YELLOW, filename, RESET);
+		return SUCCESS;
+	}
+
+	snprintf(latest_path, sizeof(latest_path), "%s/%s.%d", BACKUP_DIR, filename, latest);
+	if ((result = load_version(filename, latest, &blob)) == ERR_IO)
+	{
+		say("%sCorrupt stored version %d of %s%s\n", RED, latest, filename, RESET);
+		return ERR_IO;
+	}
+	if (result == ERR_NO_MEMORY || split_lines(&blob, &old_content) != SUCCESS ||
+		read_file(filename, &new_content) != SUCCESS)
+	{
+		out_of_memory();
+		return ERR_NO_MEMORY;
+	}
+	return diff_files(latest_path, &old_content, filename, &new_content);
+}
+
+void 
+list_versions(const char *filename)
+{
+	EnhancedVersionInfo *info = new_record();
+	FILE *history;
+
+	if (!info)
+	{
+		out_of_memory();
+		return;
+	}
+
+	history = fopen(HISTORY_FILE, "r");
+	if (!history)
+	{
+		say("%sNo history found%s\n", RED, RESET);
+		return;
+	}
+
+	say("%sAvailable versions for %s:%s\n", YELLOW, filename, RESET);
+	while (fread(info, sizeof(EnhancedVersionInfo), 1, history) == 1)
+	{
+		if (strcmp(info->filename, filename) == 0)
+		{
+			char time_str[26];
+			ctime_r(&info->timestamp, time_str);
+			time_str[24] = '\0';
+
+			say("Version %s%d%s - %s\n", CYAN,
+				   info->version, RESET, time_str);
+
+			if (info->version > 1)
+			{
+				say("Changes: %s+%d%s, %s-%d%s lines\n",
+					   GREEN, info->lines_added, RESET,
+					   RED, info->lines_removed, RESET);
+			}
+		}
+	}
+	fclose(history);
+}
+
+ErrorCode
+revert(const char *filename, int target_version)
+{
+	EnhancedVersionInfo *info = new_record();
+	int latest = 0;
+	int version_exists = 0;
+
+	if (!info)
+	{
+		out_of_memory();
+		return ERR_NO_MEMORY;
+	}
+
+	FILE *history = fopen(HISTORY_FILE, "r");
+	if (!history)
+		return ERR_NO_HISTORY;
+
+	while (fread(info, sizeof(EnhancedVersionInfo), 1, history) == 1)
+	{
+		if (strcmp(info->filename, filename) == 0)
+		{
+			if (info->version > latest)
+			{
+				latest = info->version;
+			}
+			if (info->version == target_version)
+			{
+				version_exists = 1;
+			}
+		}
+	}
+	fclose(history);
+
+	if (latest < 1)
+	{
+		say("%sNo versions found for %s%s\n", YELLOW, filename, RESET);
+		return ERR_INVALID_VERSION;
+	}
+
+	if (target_version < 1 || target_version > latest)
+	{
+		say("%sInvalid version number. Available versions: 1 to %d%s\n",
+			   RED, latest, RESET);
+		return ERR_INVALID_VERSION;
+	}
+
+	if (!version_exists)
+	{
+		say("%sVersion %d does not exist for %s%s\n",
+			   RED, target_version, filename, RESET);
+		return ERR_INVALID_VERSION;
+	}
+
+	Blob blob;
+	ErrorCode result;
+
+	if (lock_store(F_RDLCK) != 0)
+		return ERR_IO;
+
+	result = load_version(filename, target_version, &blob);
+
+	if (result == ERR_NO_MEMORY)
+	{
+		out_of_memory();
+		return result;
+	}
+	if (result == SUCCESS)
+		result = write_blob(filename, &blob);
+
+	if (result == SUCCESS)
+	{
+		say("%sReverted %s to version %d%s\n", GREEN,
+			   filename, target_version, RESET);
+	}
+	else
+	{
+		say("%sError reverting to version %d%s\n", RED,
+			   target_version, RESET);
+	}
+	return result;
+}
+
+ErrorCode
+history(void)
+{
+	EnhancedVersionInfo *info = new_record();
+	FILE *history;
+	int i;
+
+	if (!info)
+	{
+		out_of_memory();
+		return ERR_NO_MEMORY;
+	}
+
+	history = fopen(HISTORY_FILE, "rb");
+	if (!history)
+	{
+		say("%sNo history found%s\n", RED, RESET);
+		return ERR_NO_HISTORY;
+	}
+
+	say("%sVersion History:%s\n", YELLOW, RESET);
+	while (fread(info, sizeof(EnhancedVersionInfo), 1, history) == 1)
+	{
+		char time_str[26];
+		ctime_r(&info->timestamp, time_str);
+		time_str[24] = '\0';
+
+		int exists = file_exists(info->filename);
+
+		say("\n%sVersion %d%s - File: %s%s%s %s%s%s\n",
+			   CYAN, info->version, RESET,
+			   YELLOW, info->filename, RESET,
+			   exists ? GREEN : RED,
+			   exists ? "(exists)" : "(deleted)",
+			   RESET);
+		say("By: %s at %s\n", info->username, time_str);
+
+		if (info->version > 1)
+		{
+			say("Changes: %s+%d%s, %s-%d%s lines\n",
+				   GREEN, info->lines_added, RESET,
+				   RED, info->lines_removed, RESET);
+
+			say("Modified lines:\n");
+			for (i = 0; i < info->num_changes; i++)
+			{
+				if (info->change_types[i] == '+')
+				{
+					say("%s+%s%s\n", GREEN, info->changed_lines[i], RESET);
+				}
+				else
+				{
+					say("%s-%s%s\n", RED, info->changed_lines[i], RESET);
+				}
+			}
+		}
+		say("\n");
+	}
+	fclose(history);
+	return SUCCESS;
+}
+
+unsigned int
+hash_string(const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+/* open-addressing string table; keys are owned by the caller */
+int *
+strmap_get(StrMap *map, const char *key)
+{
+	unsigned int i;
+
+	if (!map->size)
+		return NULL;
+	for (i = hash_string(key) & (map->size - 1); map->keys[i];
+		 i = (i + 1) & (map->size - 1))
+	{
+		if (strcmp(map->keys[i], key) == 0)
+			return &map->vals[i];
+	}
+	return NULL;
+}
+
+void
+strmap_put(StrMap *map, char *key, int val)
+{
+	unsigned int i;
+
+	if ((map->count + 1) * 2 > map->size)
+	{
+		StrMap grown = {0};
+		int j;
+
+		grown.size = map->size ? map->size * 2 : 64;
+		grown.keys = calloc(grown.size, sizeof(char *));
+		grown.vals = calloc(grown.size, sizeof(int));
+		for (j = 0; j < map->size; j++)
+			if (map->keys[j])
+				strmap_put(&grown, map->keys[j], map->vals[j]);
+		free(map->keys);
+		free(map->vals);
+		*map = grown;
+	}
+
+	for (i = hash_string(key) & (map->size - 1); map->keys[i];
+		 i = (i + 1) & (map->size - 1))
+	{
+		if (strcmp(map->keys[i], key) == 0)
+		{
+			map->vals[i] = val;
+			return;
+		}
+	}
+	map->keys[i] = key;
+	map->vals[i] = val;
+	map->count++;
+}
+
+void
+strmap_clear(StrMap *map, int free_keys)
+{
+	int i;
+
+	if (free_keys)
+		for (i = 0; i < map->size; i++)
+			free(map->keys[i]);
+	free(map->keys);
+	free(map->vals);
+	memset(map, 0, sizeof(StrMap));
+}
+
+/* highest saved version of filename, or ERR_NO_HISTORY / ERR_NO_MEMORY,
+ * which are negative */
+int
+latest_version(const char *filename)
+{
+	EnhancedVersionInfo *info;
+	ArenaMark mark = arena_mark();
+	FILE *history;
+	int *slot, latest = 0, pending = wal_pending_version(filename);
+
+	if (repo->cache.loaded)
+	{
+		cache_catch_up();
+		latest = (slot = strmap_get(&repo->cache.versions, filename)) ? *slot : 0;
+		return latest > pending ? latest : pending;
+	}
+
+	if (!(info = new_record()))
+	{
+		out_of_memory();
+		return ERR_NO_MEMORY;
+	}
+
+	history = fopen(HISTORY_FILE, "r");
+	if (!history)
+	{
+		say("%sNo history found%s\n", RED, RESET);
+		arena_reset(mark);
+		return ERR_NO_HISTORY;
+	}
+
+	while (fread(info, sizeof(EnhancedVersionInfo), 1, history) == 1)
+		if (strcmp(info->filename, filename) == 0 && info->version > latest)
+			latest = info->version;
+	fclose(history);
+	arena_reset(mark);
+	return latest > pending ? latest : pending;
+}
+
+void
+cache_refresh(int i)
+{
+	struct stat st;
+
+	if (stat(repo->cache.files[i].path, &st) != 0)
+		repo->cache.state[i] = 'D';
+	else if (st.st_mtime > repo->cache.files[i].last_modified)
+		repo->cache.state[i] = 'M';
+	else
+		repo->cache.state[i] = ' ';
+}
+
+void
+cache_load(void)
+{
+	TrackedFile file;
+	struct stat st;
+	FILE *fp;
+	int i;
+
+	cache_free();
+
+	if ((fp = fopen(INDEX_FILE, "rb")))
+	{
+		if (fstat(fileno(fp), &st) == 0)
+		{
+			repo->cache.index_size = st.st_size;
+			repo->cache.index_ino = st.st_ino;
+			repo->cache.index_mtime = st.st_mtim;
+		}
+		while (fread(&file, sizeof(TrackedFile), 1, fp) == 1)
+		{
+			if (!(repo->cache.count & (repo->cache.count - 1)))
+			{
+				int n = repo->cache.count ? repo->cache.count * 2 : 64;
+				repo->cache.files = realloc(repo->cache.files, n * sizeof(TrackedFile));
+				repo->cache.state = realloc(repo->cache.state, n);
+			}
+			repo->cache.files[repo->cache.count++] = file;
+		}
+		fclose(fp);
+	}
+	for (i = 0; i < repo->cache.count; i++)
+	{
+		strmap_put(&repo->cache.paths, repo->cache.files[i].path, i);
+		cache_refresh(i);
+	}
+
+	repo->cache.loaded = 1;
+	cache_catch_up();
+}
+
+/* folds history records appended since the cache was built into it */
+void
+cache_catch_up(void)
+{
+	ArenaMark mark = arena_mark();
+	EnhancedVersionInfo *info;
+	struct stat st;
+	FILE *fp;
+	int *slot;
+
+	if (stat(HISTORY_FILE, &st) != 0 || st.st_size == repo->cache.history_size)
+		return;
+	if (st.st_size < repo->cache.history_size)
+	{
+		/* rewritten underneath us */
+		cache_load();
+		return;
+	}
+
+	if (!(info = new_record()) || !(fp = fopen(HISTORY_FILE, "rb")))
+		return;
+	fseeko(fp, repo->cache.history_size, SEEK_SET);
+	while (fread(info, sizeof(EnhancedVersionInfo), 1, fp) == 1)
+	{
+		if (!(slot = strmap_get(&repo->cache.versions, info->filename)))
+			strmap_put(&repo->cache.versions, strdup(info->filename), info->version);
+		else if (info->version > *slot)
+			*slot = info->version;
+		repo->cache.history_size += sizeof(EnhancedVersionInfo);
+	}
+	fclose(fp);
+	arena_reset(mark);
+}
+
+/* brings the cache up to date with whatever other processes committed;
+ * only status reads the per-file state, so the re-stat is left to it */
+void
+cache_sync(int refresh)
+{
+	struct stat st;
+	int i;
+
+	/* renames rewrite the index in place, hence the mtime */
+	if (stat(INDEX_FILE, &st) == 0 &&
+		(st.st_size != repo->cache.index_size || st.st_ino != repo->cache.index_ino ||
+		 st.st_mtim.tv_sec != repo->cache.index_mtime.tv_sec ||
+		 st.st_mtim.tv_nsec != repo->cache.index_mtime.tv_nsec))
+	{
+		cache_load();
+		return;
+	}
+	cache_catch_up();
+	for (i = 0; refresh && i < repo->cache.count; i++)
+		cache_refresh(i);
+}
+
+void
+cache_free(void)
+{
+	strmap_clear(&repo->cache.paths, 0);
+	strmap_clear(&repo->cache.versions, 1);
+	free(repo->cache.files);
+	free(repo->cache.state);
+	memset(&repo->cache, 0, sizeof(Cache));
+}
+
+static void
+daemon_signal(int sig)
+{
+	(void)sig;
+	daemon_stop = 1;
+}
+
+/* watch the directory holding every tracked file; wds index dirs[] */
+static void
+daemon_watch(int fd, char ***dirs, int *ndirs)
+{
+	char dir[MAX_PATH];
+	char *slash;
+	int i, wd;
+
+	for (i = 0; i < repo->cache.count; i++)
+	{
+		strncpy(dir, repo->cache.files[i].path, MAX_PATH - 1);
+		dir[MAX_PATH - 1] = '\0';
+		if ((slash = strrchr(dir, '/')))
+			*slash = '\0';
+		else
+			strcpy(dir, ".");
+
+		wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB |
+							   IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+		if (wd < 0)
+			continue;
+		if (wd >= *ndirs)
+		{
+			*dirs = realloc(*dirs, (wd + 1) * sizeof(char *));
+			memset(*dirs + *ndirs, 0, (wd + 1 - *ndirs) * sizeof(char *));
+			*ndirs = wd + 1;
+		}
+		if (!(*dirs)[wd])
+			(*dirs)[wd] = strdup(dir);
+	}
+}
+
+/* runs one client request with stdout redirected to the client socket */
+static void
+daemon_serve(int client)
+{
+	static char buf[64 * 1024];
+	struct timeval tv = { 5, 0 };
+	struct pollfd pfd = { client, POLLIN, 0 };
+	char *argv[64];
+	char status;
+	size_t len = 0, off;
+	ssize_t n;
+	int argc, out;
+	EwOutput output = repo->output;
+	ErrorCode result;
+
+	/* arguments arrive NUL-separated and end with an empty one; a client
+	 * that stalls is dropped instead of holding up every other request */
+	while (len < sizeof(buf) - 1 &&
+		   !(len > 0 && buf[len - 1] == '\0' && (len == 1 || buf[len - 2] == '\0')))
+	{
+		if (poll(&pfd, 1, CLIENT_TIMEOUT) <= 0)
+		{
+			close(client);
+			return;
+		}
+		if ((n = read(client, buf + len, sizeof(buf) - 1 - len)) <= 0)
+			break;
+		len += n;
+	}
+	buf[len] = '\0';
+	/* nor may one that stops reading its reply */
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	argv[0] = "ew";
+	argc = 1;
+	for (off = 0; off < len && buf[off] && argc < 63; off += strlen(buf + off) + 1)
+		argv[argc++] = buf + off;
+	argv[argc] = NULL;
+
+	fflush(stdout);
+	out = dup(STDOUT_FILENO);
+	dup2(client, STDOUT_FILENO);
+	repo->output = NULL;
+
+	if (argc < 2)
+		result = ERR_UNKNOWN_COMMAND;
+	else if (strcmp(argv[1], "status") == 0)
+		result = handle_command(CMD_STATUS, argc, argv);
+	else if (strcmp(argv[1], "diff") == 0)
+		result = handle_command(CMD_DIFF, argc, argv);
+	else if (strcmp(argv[1], "save") == 0)
+		result = handle_command(CMD_SAVE, argc, argv);
+	else
+		result = ERR_UNKNOWN_COMMAND;
+	if (wal_commit() != SUCCESS && result == SUCCESS)
+		result = ERR_IO;
+	if (result != SUCCESS)
+		print_error(result, argc > 1 ? argv[1] : "");
+	fflush(stdout);
+
+	dup2(out, STDOUT_FILENO);
+	close(out);
+	repo->output = output;
+	unlock_all();
+
+	status = result == SUCCESS ? '0' : '1';
+	write(client, &status, 1);
+	close(client);
+	arena_release();
+}
+
+/* serves status, diff and save from memory until interrupted */
+void
+daemon_run(int autosave)
+{
+	struct sockaddr_un addr = {0};
+	struct pollfd fds[2];
+	char events[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[MAX_PATH];
+	char **dirs = NULL;
+	int ndirs = 0, vcs_wd, sock, ino, i, *slot;
+
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, SOCKET_FILE, sizeof(addr.sun_path) - 1);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+	{
+		say("%sDaemon already running%s\n", YELLOW, RESET);
+		close(sock);
+		return;
+	}
+	if (sock >= 0)
+		close(sock);
+	unlink(SOCKET_FILE);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		listen(sock, 64) != 0)
+	{
+		say("%sCannot listen on %s: %s%s\n", RED, SOCKET_FILE, strerror(errno), RESET);
+		return;
+	}
+
+	ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ino < 0)
+	{
+		say("%sinotify unavailable: %s%s\n", RED, strerror(errno), RESET);
+		close(sock);
+		unlink(SOCKET_FILE);
+		return;
+	}
+
+	signal(SIGINT, daemon_signal);
+	signal(SIGTERM, daemon_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	cache_load();
+	daemon_serving = 1;
+	daemon_watch(ino, &dirs, &ndirs);
+	vcs_wd = inotify_add_watch(ino, VCS_DIR, IN_CLOSE_WRITE | IN_MOVED_TO);
+
+	say("%sDaemon watching %d files on %s%s%s\n", GREEN, repo->cache.count,
+		   SOCKET_FILE, autosave ? " (autosave)" : "", RESET);
+	fflush(stdout);
+
+	fds[0].fd = sock;
+	fds[0].events = POLLIN;
+	fds[1].fd = ino;
+	fds[1].events = POLLIN;
+
+	while (!daemon_stop)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents & POLLIN)
+		{
+			ssize_t len;
+
+			while ((len = read(ino, events, sizeof(events))) > 0)
+			{
+				for (char *p = events; p < events + len; )
+				{
+					struct inotify_event *ev = (struct inotify_event *)p;
+					p += sizeof(struct inotify_event) + ev->len;
+
+					if (!ev->len)
+						continue;
+
+					if (ev->wd == vcs_wd)
+					{
+						if (strcmp(ev->name, "index") == 0)
+						{
+							cache_load();
+							daemon_watch(ino, &dirs, &ndirs);
+						}
+						else if (strcmp(ev->name, "history") == 0)
+						{
+							cache_catch_up();
+						}
+						continue;
+					}
+
+					if (ev->wd < 0 || ev->wd >= ndirs || !dirs[ev->wd])
+						continue;
+					if (strcmp(dirs[ev->wd], ".") == 0)
+						snprintf(path, sizeof(path), "%s", ev->name);
+					else
+						snprintf(path, sizeof(path), "%s/%s", dirs[ev->wd], ev->name);
+					if (!(slot = strmap_get(&repo->cache.paths, path)))
+						continue;
+
+					i = *slot;
+					cache_refresh(i);
+					if (autosave && (ev->mask & IN_CLOSE_WRITE) &&
+						repo->cache.files[i].is_tracked && repo->cache.state[i] != 'D')
+					{
+						save(repo->cache.files[i].path);
+						arena_release();
+					}
+				}
+			}
+
+			/* one commit for everything saved from this batch of events */
+			if (wal.records)
+			{
+				wal_commit();
+				unlock_all();
+			}
+			fflush(stdout);
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			int client = accept(sock, NULL, NULL);
+			if (client >= 0)
+				daemon_serve(client);
+		}
+	}
+
+	close(sock);
+	close(ino);
+	unlink(SOCKET_FILE);
+	for (i = 0; i < ndirs; i++)
+		free(dirs[i]);
+	free(dirs);
+	cache_free();
+	daemon_serving = 0;
+	say("%sDaemon stopped%s\n", GREEN, RESET);
+}
+
+/* forwards a command to a running daemon; -1 means run it directly */
+int
+daemon_request(int argc, char *argv[])
+{
+	struct sockaddr_un addr = {0};
+	char buf[4096];
+	char last = '1';
+	ssize_t n;
+	int sock, i, have = 0;
+
+	if (access(SOCKET_FILE, F_OK) != 0)
+		return -1;
+
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, SOCKET_FILE, sizeof(addr.sun_path) - 1);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+
+	for (i = 1; i < argc; i++)
+		write(sock, argv[i], strlen(argv[i]) + 1);
+	write(sock, "", 1);
+	shutdown(sock, SHUT_WR);
+
+	/* the final byte of the reply is the exit status */
+	fflush(stdout);
+	while ((n = read(sock, buf, sizeof(buf))) > 0)
+	{
+		if (have)
+			emit(&last, 1);
+		emit(buf, n - 1);
+		last = buf[n - 1];
+		have = 1;
+	}
+	close(sock);
+	return last == '0' ? 0 : 1;
+}
+
+const char *
+ew_strerror(ErrorCode result)
+{
+	switch (result) {
+		case ERR_NO_REPO:
+			return "No repository found";
+		case ERR_NO_HISTORY:
+			return "No history found";
+		case ERR_NO_FILE:
+			return "File not found";
+		case ERR_INVALID_VERSION:
+			return "Invalid version specified";
+		case ERR_FILE_NOT_TRACKED:
+			return "File is not tracked";
+		case ERR_BINARY_FILE:
+			return "Binary files are not supported";
+		case ERR_UNKNOWN_COMMAND:
+			return "Unknown command";
+		case ERR_NO_MEMORY:
+			return "Out of memory";
+		case ERR_IO:
+			return "I/O error";
+		case ERR_INVALID_TIME:
+			return "Invalid time, use @epoch, YYYY-MM-DD [HH:MM[:SS]], HH:MM or 10m";
+		case ERR_FILE_EXISTS:
+			return "Destination already exists";
+		case ERR_CORRUPT:
+			return "Repository is damaged";
+		case ERR_INVALID_PATTERN:
+			return "Invalid regular expression";
+		default:
+			return "Unknown error occurred";
+	}
+}
+
+void
+print_error(ErrorCode result, const char *command)
+{
+	if (result == ERR_UNKNOWN_COMMAND)
+		PRINT_ERROR("Unknown command: %s", command);
+	else
+		PRINT_ERROR("%s", ew_strerror(result));
+}
+
+/* byte-range locks on LOCK_FILE: LOCK_STORE is shared by commands that
+ * read or add versions and exclusive for gc; each file's version numbers
+ * are allocated under an exclusive lock on its own slot, held until the
+ * records are committed */
+int
+lock_range(off_t start, short type)
+{
+	struct flock fl = {0};
+
+	if (lock_fd < 0 && (lock_fd = open(LOCK_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+		return -1;
+
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = type == F_UNLCK && start == LOCK_VERSIONS ? 0 : 1;
+	while (fcntl(lock_fd, F_SETLKW, &fl) != 0)
+	{
+		if (errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+int
+lock_store(short type)
+{
+	if (lock_range(LOCK_STORE, type) != 0)
+	{
+		say("%sCannot lock %s: %s%s\n", RED, LOCK_FILE, strerror(errno), RESET);
+		return -1;
+	}
+	return 0;
+}
+
+int
+lock_version(const char *filename)
+{
+	off_t slot = LOCK_VERSIONS + hash_string(filename) % LOCK_SLOTS;
+
+	while (lock_range(slot, F_WRLCK) != 0)
+	{
+		/* another writer waits on a slot we hold: publish ours and retry */
+		if (errno != EDEADLK)
+		{
+			say("%sCannot lock %s: %s%s\n", RED, LOCK_FILE, strerror(errno), RESET);
+			return -1;
+		}
+		if (wal.records)
+			wal_commit();
+		else
+			unlock_versions();
+	}
+	return 0;
+}
+
+void
+unlock_versions(void)
+{
+	if (lock_fd >= 0)
+		lock_range(LOCK_VERSIONS, F_UNLCK);
+}
+
+void
+unlock_all(void)
+{
+	struct flock fl = {0};
+
+	if (lock_fd < 0)
+		return;
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fcntl(lock_fd, F_SETLK, &fl);
+}
+
+void
+wal_append(WalType type, const void *data, size_t len)
+{
+	WalRecord rec = { WAL_MAGIC, type, len, xxh64(data, len, type) };
+	size_t need = wal.len + sizeof(WalRecord) * 2 + len;
+
+	if (need > wal.cap)
+	{
+		wal.cap = need * 2;
+		if (!(wal.buf = realloc(wal.buf, wal.cap)))
+		{
+			say("%sOut of memory queueing log record%s\n", RED, RESET);
+			exit(1);
+		}
+	}
+	memcpy(wal.buf + wal.len, &rec, sizeof(WalRecord));
+	memcpy(wal.buf + wal.len + sizeof(WalRecord), data, len);
+	wal.len += sizeof(WalRecord) + len;
+	wal.records++;
+	if (type == WAL_UNTRACK || type == WAL_RENAME)
+		wal.rewrites = 1;
+}
+
+/* names a file written for the queued records, made durable with them */
+void
+wal_file(const char *path)
+{
+	size_t len = strlen(path) + 1;
+
+	if (wal.files_len + len > wal.files_cap)
+	{
+		wal.files_cap = (wal.files_len + len) * 2;
+		if (!(wal.files = realloc(wal.files, wal.files_cap)))
+		{
+			say("%sOut of memory queueing log record%s\n", RED, RESET);
+			exit(1);
+		}
+	}
+	memcpy(wal.files + wal.files_len, path, len);
+	wal.files_len += len;
+}
+
+/* flushes the files named by wal_file() and the directories holding
+ * them, rather than the whole filesystem; 0 on success */
+static int
+wal_sync_files(void)
+{
+	char dir[MAX_PATH * 2], last[MAX_PATH * 2] = "";
+	char *slash;
+	size_t off;
+	int fd, result = 0;
+
+	for (off = 0; off < wal.files_len; off += strlen(wal.files + off) + 1)
+	{
+		if ((fd = open(wal.files + off, O_RDONLY)) < 0 || fdatasync(fd) != 0)
+			result = -1;
+		if (fd >= 0)
+			close(fd);
+
+		/* a new file is only durable once its directory entry is */
+		snprintf(dir, sizeof(dir), "%s", wal.files + off);
+		if ((slash = strrchr(dir, '/')))
+			*slash = '\0';
+		else
+			strcpy(dir, ".");
+		if (strcmp(dir, last) == 0)
+			continue;
+		strcpy(last, dir);
+		if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) < 0 || fsync(fd) != 0)
+			result = -1;
+		if (fd >= 0)
+			close(fd);
+	}
+	wal.files_len = 0;
+	return result;
+}
+
+/* 1 or 0 if a queued record tracks or untracks path, -1 if none does */
+int
+wal_pending_tracked(const char *path)
+{
+	WalRecord *rec;
+	int result = -1;
+
+	for (size_t off = 0; off < wal.len; off += sizeof(WalRecord) + rec->len)
+	{
+		rec = (WalRecord *)(wal.buf + off);
+		if (rec->type == WAL_TRACK &&
+			strcmp(((TrackedFile *)(rec + 1))->path, path) == 0)
+			result = 1;
+		else if (rec->type == WAL_UNTRACK && strcmp((char *)(rec + 1), path) == 0)
+			result = 0;
+		else if (rec->type == WAL_RENAME && strcmp((char *)(rec + 1), path) == 0)
+			result = 0;
+		else if (rec->type == WAL_RENAME &&
+				 strcmp((char *)(rec + 1) + strlen((char *)(rec + 1)) + 1, path) == 0)
+			result = 1;
+	}
+	return result;
+}
+
+int
+wal_pending_version(const char *filename)
+{
+	EnhancedVersionInfo *info;
+	WalRecord *rec;
+	int latest = 0;
+
+	for (size_t off = 0; off < wal.len; off += sizeof(WalRecord) + rec->len)
+	{
+		rec = (WalRecord *)(wal.buf + off);
+		info = (EnhancedVersionInfo *)(rec + 1);
+		if (rec->type == WAL_HISTORY && strcmp(info->filename, filename) == 0 &&
+			info->version > latest)
+			latest = info->version;
+	}
+	return latest;
+}
+
+/* rewrites the index without path; 0 on success */
+int
+index_remove(const char *path)
+{
+	char temp_index[MAX_PATH];
+	TrackedFile file;
+	FILE *index, *temp;
+
+	snprintf(temp_index, sizeof(temp_index), "%s.tmp", INDEX_FILE);
+	index = fopen(INDEX_FILE, "rb");
+	temp = fopen(temp_index, "wb");
+	if (!index || !temp)
+	{
+		if (index)
+			fclose(index);
+		if (temp)
+			fclose(temp);
+		return -1;
+	}
+
+	while (fread(&file, sizeof(TrackedFile), 1, index) == 1)
+		if (strcmp(file.path, path) != 0)
+			fwrite(&file, sizeof(TrackedFile), 1, temp);
+	fclose(index);
+
+	if (fflush(temp) != 0 || fdatasync(fileno(temp)) != 0)
+	{
+		fclose(temp);
+		return -1;
+	}
+	fclose(temp);
+	return rename(temp_index, INDEX_FILE);
+}
+
+/* 1 + the number of the record saving filename's version, 0 if none does */
+static int
+history_has(const char *filename, int version)
+{
+	EnhancedVersionInfo *info = new_record();
+	FILE *history = fopen(HISTORY_FILE, "rb");
+	int found = 0, i = 0;
+
+	if (!info || !history)
+	{
+		if (history)
+			fclose(history);
+		return 0;
+	}
+	while (!found && fread(info, sizeof(EnhancedVersionInfo), 1, history) == 1)
+	{
+		i++;
+		found = strcmp(info->filename, filename) == 0 && info->version == version;
+	}
+	fclose(history);
+	return found ? i : 0;
+}
+
+/* 1 if SUMS_FILE was written for the HISTORY_FILE now in place; a history
+ * rewritten by prune has a new inode, so a crash between the two renames
+ * leaves checksums that are known stale rather than misaligned */
+int
+sums_current(void)
+{
+	SumsHeader header;
+	struct stat st;
+	int fd, ok;
+
+	if (stat(HISTORY_FILE, &st) != 0 || (fd = open(SUMS_FILE, O_RDONLY)) < 0)
+		return 0;
+	ok = pread(fd, &header, sizeof(SumsHeader), 0) == sizeof(SumsHeader) &&
+		memcmp(header.magic, SUMS_MAGIC, sizeof(SUMS_MAGIC)) == 0 &&
+		header.ino == (uint64_t)st.st_ino;
+	close(fd);
+	return ok;
+}
+
+/* the recorded checksums of the first n history records, zero for records
+ * without one; NULL only when out of memory */
+VersionSum *
+sums_load(uint64_t n)
+{
+	VersionSum *sums;
+	ssize_t got;
+	int fd;
+
+	if (!(sums = calloc(n + 1, sizeof(VersionSum))))
+		return NULL;
+	if (!sums_current() || (fd = open(SUMS_FILE, O_RDONLY)) < 0)
+		return sums;
+	got = pread(fd, sums, n * sizeof(VersionSum), sizeof(SumsHeader));
+	close(fd);
+	if (got < 0)
+		got = 0;
+	/* a torn last entry counts as unrecorded */
+	memset((char *)sums + got / sizeof(VersionSum) * sizeof(VersionSum), 0,
+		   got % sizeof(VersionSum));
+	return sums;
+}
+
+/* opens SUMS_FILE for writing, starting it over if it is stale */
+static int
+sums_open(void)
+{
+	SumsHeader header = { SUMS_MAGIC, 0 };
+	struct stat st;
+	int fd;
+
+	if (stat(HISTORY_FILE, &st) != 0 || (fd = open(SUMS_FILE, O_RDWR | O_CREAT, 0644)) < 0)
+		return -1;
+	if (!sums_current())
+	{
+		header.ino = st.st_ino;
+		if (ftruncate(fd, 0) != 0 || pwrite(fd, &header, sizeof(SumsHeader), 0) != sizeof(SumsHeader))
+		{
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/* records the checksums of history record i and of the version it saves,
+ * read back while it is still in the page cache */
+static ErrorCode
+sums_put(int fd, uint64_t i, const EnhancedVersionInfo *info)
+{
+	VersionSum sum = { xxh64(info, sizeof(EnhancedVersionInfo), 0), 0 };
+	ArenaMark mark = arena_mark();
+	Blob blob;
+
+	if (load_version(info->filename, info->version, &blob) == SUCCESS)
+		sum.data = xxh64(blob.data, blob.len, 0);
+	arena_reset(mark);
+	if (pwrite(fd, &sum, sizeof(VersionSum), sizeof(SumsHeader) + i * sizeof(VersionSum)) !=
+		sizeof(VersionSum))
+		return ERR_IO;
+	return SUCCESS;
+}
+
+static int
+index_has(const char *path)
+{
+	TrackedFile file;
+	FILE *index = fopen(INDEX_FILE, "rb");
+	int found = 0;
+
+	if (!index)
+		return 0;
+	while (!found && fread(&file, sizeof(TrackedFile), 1, index) == 1)
+		found = strcmp(file.path, path) == 0;
+	fclose(index);
+	return found;
+}
+
+static int
+snapshot_has(int id)
+{
+	Snapshot snap;
+	FILE *fp = fopen(SNAPSHOT_FILE, "rb");
+	int found = 0;
+
+	if (!fp)
+		return 0;
+	while (!found && fread(&snap, sizeof(Snapshot), 1, fp) == 1)
+		found = snap.id == id;
+	fclose(fp);
+	return found;
+}
+
+static int
+write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t n;
+
+	while (len > 0)
+	{
+		if ((n = write(fd, p, len)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* 1 if len bytes at off read back as zeros */
+static int
+zero_range(int fd, off_t off, size_t len)
+{
+	char buf[4096];
+	size_t want, i;
+
+	for (; len > 0; off += want, len -= want)
+	{
+		want = len < sizeof(buf) ? len : sizeof(buf);
+		if (pread(fd, buf, want, off) != (ssize_t)want)
+			return 0;
+		for (i = 0; i < want; i++)
+			if (buf[i])
+				return 0;
+	}
+	return 1;
+}
+
+/* drops a torn or never written tail that a crash before the checkpoint
+ * can leave, so records replayed after it stay aligned */
+static void
+trim_torn(int fd, size_t record)
+{
+	struct stat st;
+	off_t end;
+
+	if (fstat(fd, &st) != 0)
+		return;
+	end = st.st_size - st.st_size % record;
+	while (end >= (off_t)record && zero_range(fd, end - record, record))
+		end -= record;
+	if (end != st.st_size && ftruncate(fd, end) != 0)
+		say("%sCannot trim a torn record%s\n", RED, RESET);
+}
+
+/* applies one committed group to history and index without syncing them,
+ * which is left to the checkpoint; on replay records that already made it
+ * to disk are skipped so applying twice is harmless */
+static ErrorCode
+wal_apply(const char *buf, size_t len, int replay)
+{
+	const WalRecord *rec;
+	const char **from = NULL, **to = NULL;
+	int history = -1, index = -1, snapshots = -1, sums = -1, record, renames = 0;
+	ErrorCode result = SUCCESS;
+	struct stat st;
+	ArenaMark mark = arena_mark();
+
+	for (size_t off = 0; off < len && result == SUCCESS; off += sizeof(WalRecord) + rec->len)
+	{
+		const EnhancedVersionInfo *info;
+		const TrackedFile *file;
+
+		rec = (const WalRecord *)(buf + off);
+		if (renames > 0 && rec->type != WAL_RENAME)
+		{
+			if ((result = rename_apply(from, to, renames)) != SUCCESS)
+				break;
+			renames = 0;
+		}
+		switch (rec->type)
+		{
+		case WAL_HISTORY:
+			info = (const EnhancedVersionInfo *)(rec + 1);
+			if (history < 0)
+			{
+				if ((history = open(HISTORY_FILE, O_RDWR | O_APPEND | O_CREAT, 0644)) < 0)
+				{
+					result = ERR_IO;
+					break;
+				}
+				if (replay)
+					trim_torn(history, sizeof(EnhancedVersionInfo));
+			}
+			if (replay && (record = history_has(info->filename, info->version)) > 0)
+				record--;
+			else if (fstat(history, &st) != 0 || write_all(history, info, sizeof(EnhancedVersionInfo)) != 0)
+				result = ERR_IO;
+			else
+				record = st.st_size / sizeof(EnhancedVersionInfo);
+			if (result == SUCCESS && ((sums < 0 && (sums = sums_open()) < 0) ||
+									  sums_put(sums, record, info) != SUCCESS))
+				result = ERR_IO;
+			break;
+
+		case WAL_TRACK:
+			file = (const TrackedFile *)(rec + 1);
+			if (index < 0)
+			{
+				if ((index = open(INDEX_FILE, O_RDWR | O_APPEND | O_CREAT, 0644)) < 0)
+				{
+					result = ERR_IO;
+					break;
+				}
+				if (replay)
+					trim_torn(index, sizeof(TrackedFile));
+			}
+			if (!index_has(file->path) && write_all(index, file, sizeof(TrackedFile)) != 0)
+				result = ERR_IO;
+			break;
+
+		case WAL_SNAPSHOT:
+			if (snapshots < 0)
+			{
+				if ((snapshots = open(SNAPSHOT_FILE, O_RDWR | O_APPEND | O_CREAT, 0644)) < 0)
+					break;
+				if (replay)
+					trim_torn(snapshots, sizeof(Snapshot));
+			}
+			if (replay && snapshot_has(((const Snapshot *)(rec + 1))->id))
+				break;
+			if (write_all(snapshots, rec + 1, sizeof(Snapshot)) != 0)
+				result = ERR_IO;
+			break;
+
+		case WAL_UNTRACK:
+			if (index >= 0)
+			{
+				close(index);
+				index = -1;
+			}
+			if (index_has((const char *)(rec + 1)) && index_remove((const char *)(rec + 1)) != 0)
+				result = ERR_IO;
+			break;
+
+		case WAL_RENAME:
+			/* a run of moves is applied as one batch; that is in place and
+			 * idempotent, so replay needs no check */
+			if (index >= 0)
+			{
+				close(index);
+				index = -1;
+			}
+			if (!(renames & (renames - 1)))
+			{
+				const char **grown = realloc(from, (renames ? renames * 2 : 16) * sizeof(char *));
+
+				if (grown)
+					from = grown;
+				if (!grown || !(grown = realloc(to, (renames ? renames * 2 : 16) * sizeof(char *))))
+				{
+					result = ERR_NO_MEMORY;
+					break;
+				}
+				to = grown;
+			}
+			from[renames] = (const char *)(rec + 1);
+			to[renames++] = (const char *)(rec + 1) + strlen((const char *)(rec + 1)) + 1;
+			break;
+		}
+	}
+	if (result == SUCCESS && renames > 0)
+		result = rename_apply(from, to, renames);
+	free(from);
+	free(to);
+
+	if (history >= 0)
+		close(history);
+	if (index >= 0)
+		close(index);
+	if (snapshots >= 0)
+		close(snapshots);
+	if (sums >= 0)
+		close(sums);
+	arena_reset(mark);
+	return result;
+}
+
+/* the kernel's id for the running boot; what was applied under it is still
+ * in the page cache, so only a reboot can have lost it; -1 if unknown */
+static int
+boot_id(char id[BOOT_ID_LEN])
+{
+	static char cached[BOOT_ID_LEN];
+	static int state;
+	int fd;
+
+	if (!state)
+	{
+		state = -1;
+		if ((fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY)) >= 0)
+		{
+			if (read(fd, cached, BOOT_ID_LEN) == BOOT_ID_LEN)
+				state = 1;
+			close(fd);
+		}
+	}
+	memcpy(id, cached, BOOT_ID_LEN);
+	return state > 0 ? 0 : -1;
+}
+
+/* 1 if the log ends with a WAL_APPLIED record of the running boot */
+static int
+wal_applied(int fd, off_t size)
+{
+	char buf[sizeof(WalRecord) + BOOT_ID_LEN], id[BOOT_ID_LEN];
+	WalRecord rec;
+
+	if (size < (off_t)sizeof(buf) || boot_id(id) != 0 ||
+		pread(fd, buf, sizeof(buf), size - sizeof(buf)) != (ssize_t)sizeof(buf))
+		return 0;
+	memcpy(&rec, buf, sizeof(WalRecord));
+	return rec.magic == WAL_MAGIC && rec.type == WAL_APPLIED && rec.len == BOOT_ID_LEN &&
+		rec.sum == xxh64(buf + sizeof(WalRecord), BOOT_ID_LEN, WAL_APPLIED) &&
+		memcmp(buf + sizeof(WalRecord), id, BOOT_ID_LEN) == 0;
+}
+
+/* appends a WAL_APPLIED record at end, unsynced: losing it only costs a
+ * replay; 0 on success */
+static int
+wal_mark(int fd, off_t end)
+{
+	char buf[sizeof(WalRecord) + BOOT_ID_LEN];
+	WalRecord rec = { WAL_MAGIC, WAL_APPLIED, BOOT_ID_LEN, 0 };
+
+	if (boot_id(buf + sizeof(WalRecord)) != 0)
+		return -1;
+	rec.sum = xxh64(buf + sizeof(WalRecord), BOOT_ID_LEN, WAL_APPLIED);
+	memcpy(buf, &rec, sizeof(WalRecord));
+	return pwrite(fd, buf, sizeof(buf), end) == (ssize_t)sizeof(buf) ? 0 : -1;
+}
+
+/* makes the files the log was applied to durable, then empties it */
+static ErrorCode
+wal_checkpoint(int fd)
+{
+	static const char *const files[] = { HISTORY_FILE, INDEX_FILE, SNAPSHOT_FILE, SUMS_FILE };
+	ErrorCode result = SUCCESS;
+	int f;
+
+	for (size_t i = 0; i < sizeof(files) / sizeof(*files); i++)
+	{
+		if ((f = open(files[i], O_RDONLY)) < 0)
+			continue;
+		if (fdatasync(f) != 0)
+			result = ERR_IO;
+		close(f);
+	}
+	if (result == SUCCESS && ftruncate(fd, 0) != 0)
+		result = ERR_IO;
+	return result;
+}
+
+/* applies the committed groups not yet applied under the running boot and
+ * checkpoints if there were any; *end is where the next group goes */
+static ErrorCode
+wal_replay(int fd, off_t *end)
+{
+	struct stat st;
+	WalRecord rec;
+	char *buf, id[BOOT_ID_LEN];
+	size_t off = 0, group = 0, applied = 0;
+	int groups = 0, have_id = boot_id(id) == 0;
+	ErrorCode result = SUCCESS;
+
+	*end = 0;
+	if (fstat(fd, &st) != 0)
+		return ERR_IO;
+	if (st.st_size == 0 || wal_applied(fd, st.st_size))
+	{
+		*end = st.st_size;
+		return SUCCESS;
+	}
+	if (!(buf = malloc(st.st_size)) || pread(fd, buf, st.st_size, 0) != st.st_size)
+	{
+		free(buf);
+		return ERR_IO;
+	}
+
+	/* the valid prefix ends with the last commit or applied mark; the last
+	 * mark of this boot says where replay starts */
+	while (off + sizeof(WalRecord) <= (size_t)st.st_size)
+	{
+		memcpy(&rec, buf + off, sizeof(WalRecord));
+		if (rec.magic != WAL_MAGIC || rec.len > st.st_size - off - sizeof(WalRecord))
+			break;
+		if (rec.type == WAL_COMMIT)
+		{
+			if (rec.sum != xxh64(buf + group, off - group, WAL_COMMIT))
+				break;
+		}
+		else if (rec.sum != xxh64(buf + off + sizeof(WalRecord), rec.len, rec.type))
+		{
+			break;
+		}
+		off += sizeof(WalRecord) + rec.len;
+		if (rec.type == WAL_APPLIED && have_id && rec.len == BOOT_ID_LEN &&
+			memcmp(buf + off - BOOT_ID_LEN, id, BOOT_ID_LEN) == 0)
+			applied = off;
+		if (rec.type == WAL_COMMIT || rec.type == WAL_APPLIED)
+			group = off;
+	}
+	*end = group;
+
+	for (off = applied; off < *end && result == SUCCESS; off += sizeof(WalRecord) + rec.len)
+	{
+		memcpy(&rec, buf + off, sizeof(WalRecord));
+		if (rec.type == WAL_APPLIED)
+		{
+			applied = off + sizeof(WalRecord) + rec.len;
+		}
+		else if (rec.type == WAL_COMMIT)
+		{
+			if ((result = wal_apply(buf + applied, off - applied, 1)) == SUCCESS)
+				groups++;
+			applied = off + sizeof(WalRecord);
+		}
+	}
+	free(buf);
+
+	if (result != SUCCESS)
+		return result;
+	if (groups > 0)
+	{
+		say("%sRecovered %d interrupted commit%s%s\n", YELLOW, groups,
+			   groups == 1 ? "" : "s", RESET);
+		*end = 0;
+		return wal_checkpoint(fd);
+	}
+	/* an uncommitted tail is dropped so the next group follows the last */
+	if (*end != st.st_size && ftruncate(fd, *end) != 0)
+		return ERR_IO;
+	return SUCCESS;
+}
+
+void
+wal_recover(void)
+{
+	struct stat st;
+	off_t end;
+	int fd;
+
+	if (stat(WAL_FILE, &st) != 0 || st.st_size == 0)
+		return;
+	if ((fd = open(WAL_FILE, O_RDWR)) < 0)
+		return;
+	flock(fd, LOCK_EX);
+	if (wal_replay(fd, &end) != SUCCESS)
+		say("%sCould not replay %s%s\n", RED, WAL_FILE, RESET);
+	close(fd);
+}
+
+/* replays and checkpoints the log, for commands that rewrite history
+ * outside it where a later replay must not undo them */
+ErrorCode
+wal_drain(void)
+{
+	ErrorCode result;
+	off_t end;
+	int fd;
+
+	if ((fd = open(WAL_FILE, O_RDWR | O_CREAT, 0644)) < 0)
+		return ERR_IO;
+	flock(fd, LOCK_EX);
+	if ((result = wal_replay(fd, &end)) == SUCCESS && end > 0)
+		result = wal_checkpoint(fd);
+	close(fd);
+	return result;
+}
+
+/* makes every queued record durable with a single flush of the log, then
+ * applies them; the files they touch are synced at the next checkpoint */
+ErrorCode
+wal_commit(void)
+{
+	WalRecord rec = { WAL_MAGIC, WAL_COMMIT, 0, 0 };
+	ErrorCode result;
+	off_t end;
+	int fd;
+
+	if (!wal.records)
+	{
+		wal.files_len = 0;
+		unlock_versions();
+		return SUCCESS;
+	}
+
+	rec.sum = xxh64(wal.buf, wal.len, WAL_COMMIT);
+	memcpy(wal.buf + wal.len, &rec, sizeof(WalRecord));
+
+	if ((fd = open(WAL_FILE, O_RDWR | O_CREAT, 0644)) < 0)
+		return ERR_IO;
+	flock(fd, LOCK_EX);
+
+	/* a crashed writer may have left a committed group behind; the files
+	 * this group wrote must be on disk before the log says it happened.
+	 * Moves and untracks rewrite files in place, which replaying older
+	 * groups over would undo, so they start and end a checkpoint */
+	if ((result = wal_replay(fd, &end)) == SUCCESS &&
+		(!wal.rewrites || end == 0 || (result = wal_checkpoint(fd)) == SUCCESS))
+	{
+		if (wal.rewrites)
+			end = 0;
+		if (wal_sync_files() != 0 || lseek(fd, end, SEEK_SET) != end ||
+			write_all(fd, wal.buf, wal.len + sizeof(WalRecord)) != 0 ||
+			fdatasync(fd) != 0)
+			result = ERR_IO;
+		else if ((result = wal_apply(wal.buf, wal.len, 0)) == SUCCESS)
+		{
+			end += wal.len + sizeof(WalRecord);
+			if (wal.rewrites || end > WAL_CHECKPOINT || wal_mark(fd, end) != 0)
+				result = wal_checkpoint(fd);
+		}
+	}
+	close(fd);
+
+	if (result != SUCCESS)
+		say("%sError committing to %s%s\n", RED, WAL_FILE, RESET);
+	wal.len = 0;
+	wal.files_len = 0;
+	wal.records = 0;
+	wal.rewrites = 0;
+	unlock_versions();
+	return result;
+}
+
+static int
+pack_item_cmp(const void *a, const void *b)
+{
+	const PackItem *x = a, *y = b;
+	int cmp = strcmp(x->name, y->name);
+
+	if (cmp == 0)
+		cmp = x->version - y->version;
+	if (cmp == 0)
+		cmp = y->src - x->src;
+	return cmp;
+}
+
+/* writes items, sorted by pack_item_cmp, to a new PACK_FILE; each version
+ * is stored as a delta against the one before it where that pays off */
+ErrorCode
+pack_write(PackItem *items, int n, int *written, int *deltas)
+{
+	PackTrailer trailer = {0};
+	PackEntry *entries = NULL;
+	ArenaMark mark;
+	Blob blob;
+	char path[MAX_PATH * 2];
+	char tmp[MAX_PATH];
+	char *prev = NULL, *names = NULL, *index;
+	size_t prev_len = 0, names_len = 0, names_cap = 0;
+	uint64_t off = 0, prefix, suffix;
+	int count = 0, i;
+	ErrorCode result = SUCCESS;
+	FILE *out;
+
+	*deltas = 0;
+	entries = calloc(n, sizeof(PackEntry));
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", PACK_FILE);
+	if (!entries || !(out = fopen(tmp, "wb")))
+	{
+		say("%sError creating %s%s\n", RED, tmp, RESET);
+		free(entries);
+		return ERR_IO;
+	}
+
+	for (i = 0; i < n && result == SUCCESS; i++)
+	{
+		PackEntry *e = &entries[count];
+		int same = count > 0 && strcmp(items[i].name, names + entries[count - 1].name) == 0;
+
+		/* duplicates sort with the packed copy first */
+		if (same && entries[count - 1].version == (uint32_t)items[i].version)
+			continue;
+
+		mark = arena_mark();
+		if (items[i].src >= 0)
+		{
+			result = pack_read(items[i].src, &blob);
+		}
+		else
+		{
+			snprintf(path, sizeof(path), "%s/%s.%d", BACKUP_DIR, items[i].name, items[i].version);
+			result = read_blob(path, &blob);
+		}
+		if (result != SUCCESS)
+		{
+			say("%sCannot read version %d of %s%s\n", RED, items[i].version, items[i].name, RESET);
+			break;
+		}
+
+		if (same)
+		{
+			e->name = entries[count - 1].name;
+		}
+		else
+		{
+			size_t len = strlen(items[i].name) + 1;
+			if (names_len + len > names_cap)
+				names = realloc(names, names_cap = (names_len + len) * 2);
+			memcpy(names + names_len, items[i].name, len);
+			e->name = names_len;
+			names_len += len;
+		}
+		e->version = items[i].version;
+		e->size = blob.len;
+		e->sum = xxh64(blob.data, blob.len, 0);
+		e->offset = off;
+		e->base = -1;
+
+		if (same && entries[count - 1].depth < PACK_DEPTH)
+		{
+			size_t max = blob.len < prev_len ? blob.len : prev_len;
+
+			for (prefix = 0; prefix < max && blob.data[prefix] == prev[prefix]; prefix++)
+				;
+			for (suffix = 0; prefix + suffix < max &&
+				 blob.data[blob.len - 1 - suffix] == prev[prev_len - 1 - suffix]; suffix++)
+				;
+			if (16 + blob.len - prefix - suffix < blob.len * 3 / 4)
+			{
+				e->base = count - 1;
+				e->depth = entries[count - 1].depth + 1;
+				e->length = 16 + blob.len - prefix - suffix;
+				fwrite(&prefix, 8, 1, out);
+				fwrite(&suffix, 8, 1, out);
+				fwrite(blob.data + prefix, 1, blob.len - prefix - suffix, out);
+				(*deltas)++;
+			}
+		}
+		if (e->base < 0)
+		{
+			e->length = blob.len;
+			fwrite(blob.data, 1, blob.len, out);
+		}
+		off += e->length;
+		count++;
+
+		prev = realloc(prev, blob.len + 1);
+		memcpy(prev, blob.data, blob.len);
+		prev_len = blob.len;
+		arena_reset(mark);
+	}
+
+	if (result == SUCCESS)
+	{
+		size_t index_len = count * sizeof(PackEntry) + names_len;
+		static const char pad[__alignof__(PackEntry)];
+
+		/* the index is used in place through the map, so it is aligned */
+		fwrite(pad, 1, -off & (__alignof__(PackEntry) - 1), out);
+		off += -off & (__alignof__(PackEntry) - 1);
+		index = malloc(index_len);
+		memcpy(index, entries, count * sizeof(PackEntry));
+		memcpy(index + count * sizeof(PackEntry), names, names_len);
+		trailer.index = off;
+		trailer.sum = xxh64(index, index_len, 0);
+		trailer.count = count;
+		trailer.names = names_len;
+		memcpy(trailer.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+		fwrite(index, 1, index_len, out);
+		fwrite(&trailer, sizeof(PackTrailer), 1, out);
+		free(index);
+	}
+
+	if (fflush(out) != 0 || fsync(fileno(out)) != 0 || ferror(out))
+		result = ERR_IO;
+	fclose(out);
+
+	if (result != SUCCESS || rename(tmp, PACK_FILE) != 0)
+	{
+		unlink(tmp);
+		result = ERR_IO;
+	}
+	*written = count;
+
+	free(prev);
+	free(names);
+	free(entries);
+	return result;
+}
+
+/* doubles the item array; on failure it is left as it was and cap is set
+ * to -1 */
+static int
+pack_items_grow(PackItem **items, int *cap)
+{
+	int size = *cap ? *cap * 2 : 256;
+	PackItem *grown = realloc(*items, size * sizeof(PackItem));
+
+	if (!grown)
+	{
+		*cap = -1;
+		return 0;
+	}
+	*items = grown;
+	*cap = size;
+	return 1;
+}
+
+/* packs every loose version except the newest of each file into PACK_FILE,
+ * storing each object as a delta against its predecessor when that pays off */
+ErrorCode
+gc(void)
+{
+	EnhancedVersionInfo *info = new_record();
+	PackItem *items = NULL;
+	StrMap latest = {0};
+	char path[MAX_PATH * 2];
+	ErrorCode result;
+	int n = 0, cap = 0, count = 0, loose = 0, deltas = 0, i, *slot;
+	FILE *fp;
+
+	if (!info)
+	{
+		out_of_memory();
+		return ERR_NO_MEMORY;
+	}
+
+	if (lock_store(F_WRLCK) != 0)
+		return ERR_IO;
+
+	if (!(fp = fopen(HISTORY_FILE, "rb")))
+	{
+		say("%sNo history found%s\n", RED, RESET);
+		return ERR_NO_HISTORY;
+	}
+	while (fread(info, sizeof(EnhancedVersionInfo), 1, fp) == 1)
+	{
+		if (!(slot = strmap_get(&latest, info->filename)))
+		{
+			char *name = arena_alloc(strlen(info->filename) + 1);
+			if (!name)
+			{
+				out_of_memory();
+				fclose(fp);
+				strmap_clear(&latest, 0);
+				return ERR_NO_MEMORY;
+			}
+			strmap_put(&latest, strcpy(name, info->filename), info->version);
+		}
+		else if (info->version > *slot)
+		{
+			*slot = info->version;
+		}
+	}
+
+	/* candidates: everything already packed plus loose non-latest versions */
+	if (pack_open() == 0)
+	{
+		for (i = 0; i < (int)pack.count; i++)
+		{
+			if (n == cap && !pack_items_grow(&items, &cap))
+				break;
+			items[n].name = pack.names + pack.entries[i].name;
+			items[n].version = pack.entries[i].version;
+			items[n++].src = i;
+		}
+	}
+	rewind(fp);
+	while (cap >= 0 && fread(info, sizeof(EnhancedVersionInfo), 1, fp) == 1)
+	{
+		slot = strmap_get(&latest, info->filename);
+		if (info->version >= *slot)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s.%d", BACKUP_DIR, info->filename, info->version);
+		if (access(path, F_OK) != 0)
+			continue;
+		if (n == cap && !pack_items_grow(&items, &cap))
+			break;
+		items[n].name = latest.keys[slot - latest.vals];
+		items[n].version = info->version;
+		items[n++].src = -1;
+		loose++;
+	}
+	fclose(fp);
+
+	/* a partial list would drop whatever did not fit from the pack */
+	if (cap < 0)
+	{
+		out_of_memory();
+		free(items);
+		strmap_clear(&latest, 0);
+		return ERR_NO_MEMORY;
+	}
+	if (loose == 0)
+	{
+		say("%sNothing to pack%s\n", YELLOW, RESET);
+		free(items);
+		strmap_clear(&latest, 0);
+		return SUCCESS;
+	}
+	qsort(items, n, sizeof(PackItem), pack_item_cmp);
+
+	if ((result = pack_write(items, n, &count, &deltas)) != SUCCESS)
+	{
+		say("%sgc failed, loose versions left in place%s\n", RED, RESET);
+	}
+	else
+	{
+		for (i = 0; i < n; i++)
+		{
+			if (items[i].src >= 0)
+				continue;
+			snprintf(path, sizeof(path), "%s/%s.%d", BACKUP_DIR, items[i].name, items[i].version);
+			unlink(path);
+		}
+		say("%sPacked %d versions (%d as deltas), removed %d loose files%s\n",
+			   GREEN, count, deltas, loose, RESET);
+	}
+
+	free(items);
+	strmap_clear(&latest, 0);
+	return result;
+}
+
+static int
+tree_item_cmp(const void *a, const void *b)
+{
+	return strcmp(((const TreeItem *)a)->path, ((const TreeItem *)b)->path);
+}
+
+/* writes the tree for items[0..n), which share their first prefix bytes,
+ * and returns its hash; existing objects are reused, not rewritten */
+static ErrorCode
+write_tree(TreeItem *items, int n, size_t prefix, uint64_t *hash, int *written)
+{
+	char path[MAX_PATH];
+	char *buf = NULL;
+	size_t len = 0, cap = 0;
+	ErrorCode result = SUCCESS;
+	Blob blob;
+	int i, j;
+
+	for (i = 0; i < n && result == SUCCESS; i = j)
+	{
+		const char *name = items[i].path + prefix;
+		const char *slash = strchr(name, '/');
+		char line[MAX_PATH + 64];
+		int l;
+
+		if (slash)
+		{
+			size_t dir = slash - name + 1;
+			uint64_t sub;
+
+			for (j = i + 1; j < n && strncmp(items[j].path + prefix, name, dir) == 0; j++)
+				;
+			result = write_tree(items + i, j - i, prefix + dir, &sub, written);
+			l = snprintf(line, sizeof(line), "t %016llx %.*s\n",
+						 (unsigned long long)sub, (int)(dir - 1), name);
+		}
+		else
+		{
+			j = i + 1;
+			l = snprintf(line, sizeof(line), "f %d %s\n", items[i].version, name);
+		}
+
+		if (len + l > cap && !(buf = realloc(buf, cap = (len + l) * 2)))
+			return ERR_NO_MEMORY;
+		memcpy(buf + len, line, l);
+		len += l;
+	}
+
+	if (result == SUCCESS)
+	{
+		*hash = xxh64(buf, len, 0);
+		snprintf(path, sizeof(path), "%s/%016llx", OBJECT_DIR, (unsigned long long)*hash);
+		if (access(path, F_OK) != 0)
+		{
+			blob.data = buf;
+			blob.len = len;
+			if ((result = write_blob(path, &blob)) == SUCCESS)
+			{
+				wal_file(path);
+				(*written)++;
+			}
+		}
+	}
+	free(buf);
+	return result;
+}
+
+/* saves every modified tracked file, then records a tree of the current
+ * version of each one */
+ErrorCode
+snapshot(void)
+{
+	EnhancedVersionInfo *info = new_record();
+	Snapshot *snap = arena_alloc(sizeof(Snapshot));
+	TreeItem *items = NULL;
+	TrackedFile file;
+	StrMap paths = {0};
+	time_t *stamps = NULL;
+	struct stat st;
+	Blob current, stored;
+	FILE *fp;
+	int n = 0, saved = 0, written = 0, i, *slot;
+	ErrorCode result = SUCCESS;
+
+	if (!info || !snap)
+	{
+		out_of_memory();
+		return ERR_NO_MEMORY;
+	}
+	if (lock_store(F_RDLCK) != 0 || lock_version(SNAPSHOT_FILE) != 0)
+		return ERR_IO;
+
+	if ((fp = fopen(INDEX_FILE, "rb")))
+	{
+		while (fread(&file, sizeof(TrackedFile), 1, fp) == 1)
+		{
+			char *path;
+
+			if (!file.is_tracked || stat(file.path, &st) != 0 || strmap_get(&paths, file.path))
+				continue;
+			if (!(n & (n - 1)))
+			{
+				TreeItem *grown = realloc(items, (n ? n * 2 : 64) * sizeof(TreeItem));
+				time_t *grown_stamps;
+
+				if (grown)
+					items = grown;
+				if (!grown || !(grown_stamps = realloc(stamps, (n ? n * 2 : 64) * sizeof(time_t))))
+				{
+					result = ERR_NO_MEMORY;
+					break;
+				}
+				stamps = grown_stamps;
+			}
+			if (!(path = arena_alloc(strlen(file.path) + 1)))
+			{
+				result = ERR_NO_MEMORY;
+				break;
+			}
+			items[n].path = strcpy(path, file.path);
+			items[n].version = 0;
+			stamps[n] = 0;
+			strmap_put(&paths, path, n++);
+		}
+		fclose(fp);
+	}
+	if (result != SUCCESS || n == 0)
+	{
+		if (result != SUCCESS)
+			out_of_memory();
+		else
+			say("%sNo tracked files%s\n", YELLOW, RESET);
+		free(items);
+		free(stamps);
+		strmap_clear(&paths, 0);
+		return result;
+	}
+
+	if ((fp = fopen(HISTORY_FILE, "rb")))
+	{
+		while (fread(info, sizeof(EnhancedVersionInfo), 1, fp) == 1)
+		{
+			if ((slot = strmap_get(&paths, info->filename)) &&
+				info->version > items[*slot].version)
+			{
+				items[*slot].version = info->version;
+				stamps[*slot] = info->timestamp;
+			}
+		}
+		fclose(fp);
+	}
+
+	/* anything touched since its last save is compared and saved if changed */
+	for (i = 0; i < n; i++)
+	{
+		ArenaMark mark = arena_mark();
+		int changed = items[i].version == 0;
+
+		if (!changed && stat(items[i].path, &st) == 0 && st.st_mtime >= stamps[i])
+		{
+			if (read_blob(items[i].path, &current) != SUCCESS ||
+				(result = load_version(items[i].path, items[i].version, &stored)) == ERR_NO_MEMORY)
+			{
+				arena_reset(mark);
+				out_of_memory();
+				result = ERR_NO_MEMORY;
+				break;
+			}
+			changed = result != SUCCESS || current.len != stored.len ||
+				memcmp(current.data, stored.data, current.len) != 0;
+		}
+		arena_reset(mark);
+
+		/* a snapshot of stale content would be worse than none */
+		if (changed)
+		{
+			result = save(items[i].path);
+			arena_reset(mark);
+			if (result != SUCCESS)
+			{
+				say("%sCould not save %s, no snapshot taken%s\n", RED, items[i].path, RESET);
+				break;
+			}
+			items[i].version = repo->saved;
+			saved++;
+		}
+	}
+
+	if (i == n)
+	{
+		qsort(items, n, sizeof(TreeItem), tree_item_cmp);
+		memset(snap, 0, sizeof(Snapshot));
+		if ((result = write_tree(items, n, 0, &snap->tree, &written)) != SUCCESS)
+		{
+			say("%sError writing tree objects%s\n", RED, RESET);
+		}
+		else
+		{
+			snap->id = snapshot_last() + 1;
+			snap->files = n;
+			snap->timestamp = time(NULL);
+			strncpy(snap->username, get_username(), MAX_PATH - 1);
+			wal_append(WAL_SNAPSHOT, snap, sizeof(Snapshot));
+			say("%sSnapshot %d: %d files, %d saved, %d new tree objects%s\n",
+				   GREEN, snap->id, n, saved, written, RESET);
+		}
+	}
+
+	free(items);
+	free(stamps);
+	strmap_clear(&paths, 0);
+	return result;
+}
+
+void
+list_snapshots(void)
+{
+	Snapshot snap;
+	FILE *fp = fopen(SNAPSHOT_FILE, "rb");
+
+	if (!fp)
+	{
+		say("%sNo snapshots%s\n", YELLOW, RESET);
+		return;
+	}
+
+	say("%sSnapshots:%s\n", YELLOW, RESET);
+	while (fread(&snap, sizeof(Snapshot), 1, fp) == 1)
+	{
+		char time_str[26];
+		ctime_r(&snap.timestamp, time_str);
+		time_str[24] = '\0';
+		say(" %s%d%s - %s by %s, %d files\n", CYAN, snap.id, RESET,
+			   time_str, snap.username, snap.files);
+	}
+	fclose(fp);
+}
+
+/* rewrites the files below a tree of snapshot snap that differ from their
+ * recorded version, loaded under the name the file has since moved to */
+static ErrorCode
+restore_tree(uint64_t hash, const char *prefix, const Moves *moves, int snap,
+			 int *restored, int *unchanged)
+{
+	char path[MAX_PATH];
+	char *line, *next, *name;
+	ArenaMark mark = arena_mark();
+	ErrorCode result = SUCCESS;
+	Blob tree, current, stored;
+
+	snprintf(path, sizeof(path), "%s/%016llx", OBJECT_DIR, (unsigned long long)hash);
+	if (read_blob(path, &tree) != SUCCESS || xxh64(tree.data, tree.len, 0) != hash)
+	{
+		say("%sMissing or corrupt tree object %s%s\n", RED, path, RESET);
+		return ERR_IO;
+	}
+
+	for (line = tree.data; result == SUCCESS && line < tree.data + tree.len; line = next)
+	{
+		ArenaMark file_mark = arena_mark();
+
+		if ((next = strchr(line, '\n')))
+			*next++ = '\0';
+		else
+			next = tree.data + tree.len;
+		if (!(name = strchr(line + 2, ' ')))
+			continue;
+		*name++ = '\0';
+		snprintf(path, sizeof(path), "%s%s", prefix, name);
+
+		if (line[0] == 't')
+		{
+			strcat(path, "/");
+			result = restore_tree(strtoull(line + 2, NULL, 16), path, moves, snap, restored, unchanged);
+			continue;
+		}
+
+		if ((result = load_version(move_follow(moves, path, snap), atoi(line + 2), &stored)) != SUCCESS)
+		{
+			say("%sCannot load version %s of %s%s\n", RED, line + 2, path, RESET);
+			break;
+		}
+		if (read_blob(path, &current) == SUCCESS && current.len == stored.len &&
+			memcmp(current.data, stored.data, stored.len) == 0)
+		{
+			(*unchanged)++;
+		}
+		else if ((result = write_blob(path, &stored)) == SUCCESS)
+		{
+			say(" %s%s (version %s)%s\n", GREEN, path, line + 2, RESET);
+			(*restored)++;
+		}
+		arena_reset(file_mark);
+	}
+	arena_reset(mark);
+	return result;
+}
+
+ErrorCode
+restore(int id)
+{
+	Snapshot snap;
+	Moves moves;
+	FILE *fp = fopen(SNAPSHOT_FILE, "rb");
+	int found = 0, restored = 0, unchanged = 0;
+	ErrorCode result;
+
+	if (!fp)
+	{
+		say("%sNo snapshots%s\n", YELLOW, RESET);
+		return ERR_INVALID_VERSION;
+	}
+	while (!found && fread(&snap, sizeof(Snapshot), 1, fp) == 1)
+		found = snap.id == id;
+	fclose(fp);
+
+	if (!found)
+	{
+		say("%sSnapshot %d does not exist%s\n", RED, id, RESET);
+		return ERR_INVALID_VERSION;
+	}
+	if (lock_store(F_RDLCK) != 0)
+		return ERR_IO;
+	if ((result = moves_load(&moves)) != SUCCESS)
+	{
+		out_of_memory();
+		return result;
+	}
+
+	if ((result = restore_tree(snap.tree, "", &moves, id, &restored, &unchanged)) == SUCCESS)
+		say("%sRestored snapshot %d: %d files rewritten, %d unchanged%s\n",
+			   GREEN, id, restored, unchanged, RESET);
+	else
+		say("%sRestore of snapshot %d incomplete%s\n", RED, id, RESET);
+	return result;
+}
+
+/* reads "keep-last N", "keep-daily DAYS" and "max-bytes SIZE" lines,
+ * returns how many rules are set */
+int
+retention_load(Retention *rules)
+{
+	char line[256], key[64], value[64];
+	FILE *fp;
+	int n = 0;
+
+	memset(rules, 0, sizeof(Retention));
+	if (!(fp = fopen(CONFIG_FILE, "r")))
+		return 0;
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (line[0] == '#' || sscanf(line, "%63s %63s", key, value) != 2)
+			continue;
+		if (strcmp(key, "keep-last") == 0)
+			n += (rules->keep_last = atoi(value)) > 0;
+		else if (strcmp(key, "keep-daily") == 0)
+			n += (rules->keep_daily = atoi(value)) > 0;
+		else if (strcmp(key, "max-bytes") == 0)
+			n += (rules->max_bytes = parse_size(value)) > 0;
+		else
+			say("%sUnknown setting in %s: %s%s\n", YELLOW, CONFIG_FILE, key, RESET);
+	}
+	fclose(fp);
+	return n;
+}
+
+/* collects every version a tree of snapshot snap refers to, by the name
+ * each file has now; a tree is read once per snapshot and path */
+ErrorCode
+pin_tree(uint64_t hash, const char *prefix, const Moves *moves, int snap,
+		 HashSet *trees, HashSet *pins)
+{
+	char path[MAX_PATH];
+	char *line, *next, *name;
+	ArenaMark mark = arena_mark();
+	ErrorCode result = SUCCESS;
+	Blob tree;
+
+	if (!hashset_add(trees, hash ^ xxh64(prefix, strlen(prefix), snap)))
+		return SUCCESS;
+
+	snprintf(path, sizeof(path), "%s/%016llx", OBJECT_DIR, (unsigned long long)hash);
+	if (read_blob(path, &tree) != SUCCESS || xxh64(tree.data, tree.len, 0) != hash)
+	{
+		say("%sMissing or corrupt tree object %s%s\n", RED, path, RESET);
+		return ERR_IO;
+	}
+
+	for (line = tree.data; result == SUCCESS && line < tree.data + tree.len; line = next)
+	{
+		if ((next = strchr(line, '\n')))
+			*next++ = '\0';
+		else
+			next = tree.data + tree.len;
+		if (!(name = strchr(line + 2, ' ')))
+			continue;
+		*name++ = '\0';
+		snprintf(path, sizeof(path), "%s%s", prefix, name);
+
+		if (line[0] == 't')
+		{
+			strcat(path, "/");
+			result = pin_tree(strtoull(line + 2, NULL, 16), path, moves, snap, trees, pins);
+		}
+		else
+		{
+			const char *name = move_follow(moves, path, snap);
+
+			hashset_add(pins, xxh64(name, strlen(name), atoi(line + 2)));
+		}
+	}
+	arena_reset(mark);
+	return result;
+}
+
+static int
+prune_item_cmp(const void *a, const void *b)
+{
+	const PruneItem *x = a, *y = b;
+	int cmp = strcmp(x->name, y->name);
+
+	return cmp ? cmp : y->version - x->version;
+}
+
+/* rewrites HISTORY_FILE without the dropped records, and SUMS_FILE to
+ * match; the checksums go in after the history, tied to its new inode */
+static ErrorCode
+prune_history(const char *drop, int n)
+{
+	EnhancedVersionInfo *info = new_record();
+	SumsHeader header = { SUMS_MAGIC, 0 };
+	VersionSum *sums = sums_load(n), none = { 0, 0 };
+	char tmp[MAX_PATH], sums_tmp[MAX_PATH];
+	struct stat st;
+	FILE *fp, *out, *sums_out;
+	int i, ok;
+
+	if (!info || !sums)
+	{
+		free(sums);
+		return ERR_NO_MEMORY;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", HISTORY_FILE);
+	snprintf(sums_tmp, sizeof(sums_tmp), "%s.tmp", SUMS_FILE);
+	if (!(fp = fopen(HISTORY_FILE, "rb")))
+	{
+		free(sums);
+		return ERR_NO_HISTORY;
+	}
+	out = fopen(tmp, "wb");
+	sums_out = fopen(sums_tmp, "wb");
+	if (!out || !sums_out || fstat(fileno(out), &st) != 0)
+	{
+		if (out)
+			fclose(out);
+		if (sums_out)
+			fclose(sums_out);
+		fclose(fp);
+		free(sums);
+		unlink(tmp);
+		unlink(sums_tmp);
+		return ERR_IO;
+	}
+	header.ino = st.st_ino;
+	fwrite(&header, sizeof(SumsHeader), 1, sums_out);
+	for (i = 0; fread(info, sizeof(EnhancedVersionInfo), 1, fp) == 1; i++)
+	{
+		if (i < n && drop[i])
+			continue;
+		fwrite(info, sizeof(EnhancedVersionInfo), 1, out);
+		fwrite(i < n ? &sums[i] : &none, sizeof(VersionSum), 1, sums_out);
+	}
+	fclose(fp);
+	free(sums);
+
+	ok = fflush(out) == 0 && fsync(fileno(out)) == 0 && !ferror(out);
+	fclose(out);
+	if (fflush(sums_out) != 0 || fsync(fileno(sums_out)) != 0 || ferror(sums_out))
+		ok = 0;
+	fclose(sums_out);
+	if (!ok || rename(tmp, HISTORY_FILE) != 0)
+	{
+		unlink(tmp);
+		unlink(sums_tmp);
+		return ERR_IO;
+	}
+	if (rename(sums_tmp, SUMS_FILE) != 0)
+		unlink(sums_tmp);
+	/* record numbers moved; the next revert --at rebuilds it */
+	unlink(TIME_INDEX);
+	return SUCCESS;
+}
+
+/* writes the pack again without the versions in gone */
+static ErrorCode
+prune_pack(const HashSet *gone)
+{
+	PackItem *keep;
+	int kept = 0, count, deltas, i;
+	ErrorCode result;
+
+	if (pack_open() != 0)
+		return SUCCESS;
+	if (!(keep = malloc(pack.count * sizeof(PackItem))))
+		return ERR_NO_MEMORY;
+	for (i = 0; i < (int)pack.count; i++)
+	{
+		const char *name = pack.names + pack.entries[i].name;
+
+		if (hashset_has(gone, xxh64(name, strlen(name), pack.entries[i].version)))
+			continue;
+		keep[kept].name = name;
+		keep[kept].version = pack.entries[i].version;
+		keep[kept++].src = i;
+	}
+
+	if (kept == 0)
+		result = unlink(PACK_FILE) == 0 ? SUCCESS : ERR_IO;
+	else
+		result = pack_write(keep, kept, &count, &deltas);
+	free(keep);
+	return result;
+}
+
+/* 1 once versions no kept record uses make up 1/PACK_DEAD_SHARE of the
+ * pack, adding them all to gone; short of that, rewriting the pack is not
+ * worth it and they stay in it unused until a later prune. A dropped base
+ * of a kept delta is not counted: its content moves into the delta */
+static int
+prune_repack(const PruneItem *items, int n, HashSet *gone)
+{
+	uint64_t dead = 0;
+	char *live;
+	int32_t b;
+	uint32_t k;
+	int i;
+
+	if (pack_open() != 0 || !(live = calloc(pack.count, 1)))
+		return 0;
+	for (i = 0; i < n; i++)
+		if (!items[i].drop && items[i].packed >= 0)
+			live[items[i].packed] = 1;
+	for (k = 0; k < pack.count; k++)
+		for (b = live[k] == 1 ? pack.entries[k].base : -1; b >= 0 && !live[b]; b = pack.entries[b].base)
+			live[b] = 2;
+	for (k = 0; k < pack.count; k++)
+		if (!live[k])
+			dead += pack.entries[k].size;
+	if (dead * PACK_DEAD_SHARE < pack.size)
+	{
+		free(live);
+		return 0;
+	}
+	for (k = 0; k < pack.count; k++)
+	{
+		const char *name = pack.names + pack.entries[k].name;
+
+		if (live[k] != 1)
+			hashset_add(gone, xxh64(name, strlen(name), pack.entries[k].version));
+	}
+	free(live);
+	return 1;
+}
+
+/* applies the retention rules to every file: of the versions the keep
+ * rules select, the oldest are dropped beyond max-bytes, but the newest
+ * version of a file and versions in snapshots always stay */
+ErrorCode
+prune(int dry_run)
+{
+	EnhancedVersionInfo *info = new_record();
+	Retention rules;
+	PruneItem *items = NULL;
+	StrMap names = {0};
+	HashSet trees = {0}, pins = {0}, gone = {0};
+	Snapshot snap;
+	Moves moves;
+	struct stat st;
+	char path[MAX_PATH * 2];
+	char *drop = NULL;
+	uint64_t bytes = 0, freed = 0;
+	time_t now = time(NULL);
+	int n = 0, cap = 0, dropped = 0, files = 0, i, j, *slot;
+	ErrorCode result = SUCCESS;
+	FILE *fp;
+
+	if (!info)
+	{
+		out_of_memory();
+		return ERR_NO_MEMORY;
+	}
+	if (!retention_load(&rules))
+	{
+		say("%sNo retention rules in %s (keep-last, keep-daily, max-bytes)%s\n",
+			YELLOW, CONFIG_FILE, RESET);
+		return SUCCESS;
+	}
+	/* dropped records must not come back from the log */
+	if (lock_store(F_WRLCK) != 0 || (!dry_run && wal_drain() != SUCCESS))
+		return ERR_IO;
+	if (moves_load(&moves) != SUCCESS)
+	{
+		out_of_memory();
+		return ERR_NO_MEMORY;
+	}
+
+	if ((fp = fopen(SNAPSHOT_FILE, "rb")))
+	{
+		while (result == SUCCESS && fread(&snap, sizeof(Snapshot), 1, fp) == 1)
+			result = pin_tree(snap.tree, "", &moves, snap.id, &trees, &pins);
+		fclose(fp);
+	}
+	free(trees.keys);
+	if (result != SUCCESS)
+	{
+		say("%sCannot tell which versions snapshots use, nothing pruned%s\n", RED, RESET);
+		free(pins.keys);
+		return result;
+	}
+
+	if (!(fp = fopen(HISTORY_FILE, "rb")))
+	{
+		say("%sNo history found%s\n", RED, RESET);
+		free(pins.keys);
+		return ERR_NO_HISTORY;
+	}
+	pack_open();
+	while (fread(info, sizeof(EnhancedVersionInfo), 1, fp) == 1)
+	{
+		PruneItem *it;
+
+		if (n == cap)
+		{
+			PruneItem *grown = realloc(items, (cap = cap ? cap * 2 : 256) * sizeof(PruneItem));
+			if (!grown)
+			{
+				result = ERR_NO_MEMORY;
+				break;
+			}
+			items = grown;
+		}
+		if (!(slot = strmap_get(&names, info->filename)))
+		{
+			char *name = arena_alloc(strlen(info->filename) + 1);
+			if (!name)
+			{
+				result = ERR_NO_MEMORY;
+				break;
+			}
+			strmap_put(&names, strcpy(name, info->filename), 0);
+			slot = strmap_get(&names, name);
+			files++;
+		}
+		it = &items[n];
+		it->name = names.keys[slot - names.vals];
+		it->version = info->version;
+		it->record = n++;
+		it->timestamp = info->timestamp;
+		it->packed = pack_find(it->name, it->version);
+		it->drop = 0;
+
+		/* rules count the versions' own sizes, not what their deltas take */
+		snprintf(path, sizeof(path), "%s/%s.%d", BACKUP_DIR, it->name, it->version);
+		if ((it->loose = stat(path, &st) == 0))
+			it->bytes = st.st_size;
+		else
+			it->bytes = it->packed >= 0 ? pack.entries[it->packed].size : 0;
+	}
+	fclose(fp);
+	if (result != SUCCESS)
+	{
+		/* deciding on part of the history could drop a file's newest version */
+		out_of_memory();
+		free(items);
+		free(pins.keys);
+		strmap_clear(&names, 0);
+		return result;
+	}
+
+	/* newest first within each file */
+	qsort(items, n, sizeof(PruneItem), prune_item_cmp);
+	for (i = 0; i < n; i = j)
+	{
+		uint64_t kept_bytes = 0;
+		int rank, day, prev_day = -1, full = 0;
+
+		for (j = i, rank = 0; j < n && items[j].name == items[i].name; j++, rank++)
+		{
+			PruneItem *it = &items[j];
+			struct tm tm;
+			int keep = !rules.keep_last && !rules.keep_daily;
+
+			localtime_r(&it->timestamp, &tm);
+			day = tm.tm_year * 400 + tm.tm_yday;
+			if (rules.keep_last && rank < rules.keep_last)
+				keep = 1;
+			if (rules.keep_daily && (now - it->timestamp < rules.keep_daily * 86400L || day != prev_day))
+				keep = 1;
+			prev_day = day;
+			if (keep && rules.max_bytes && (full || kept_bytes + it->bytes > rules.max_bytes))
+				keep = 0, full = 1;
+
+			if (rank == 0 || hashset_has(&pins, xxh64(it->name, strlen(it->name), it->version)))
+				keep = 1;
+			if (keep)
+			{
+				kept_bytes += it->bytes;
+				continue;
+			}
+			it->drop = 1;
+			dropped++;
+			bytes += it->bytes;
+			hashset_add(&gone, xxh64(it->name, strlen(it->name), it->version));
+			if (dry_run)
+				say(" %s%s (version %d)%s\n", YELLOW, it->name, it->version, RESET);
+		}
+	}
+
+	if (dropped == 0)
+	{
+		say("%sNothing to prune%s\n", YELLOW, RESET);
+	}
+	else if (dry_run)
+	{
+		say("%sWould prune %d of %d versions, %llu bytes%s\n", GREEN, dropped, n,
+			(unsigned long long)bytes, RESET);
+	}
+	else if (!(drop = calloc(n, 1)))
+	{
+		out_of_memory();
+		result = ERR_NO_MEMORY;
+	}
+	else
+	{
+		for (i = 0; i < n; i++)
+			drop[items[i].record] = items[i].drop;
+
+		/* history goes first: a crash after it leaves unused objects behind,
+		 * never records pointing at missing ones */
+		if ((result = prune_history(drop, n)) != SUCCESS)
+		{
+			say("%sCould not rewrite %s, nothing pruned%s\n", RED, HISTORY_FILE, RESET);
+		}
+		else
+		{
+			/* deltas may be rebased, so count what the pack really shrank by */
+			if (prune_repack(items, n, &gone))
+			{
+				uint64_t before = pack.size;
+
+				if ((result = prune_pack(&gone)) != SUCCESS)
+					say("%sCould not rewrite %s, dropped versions stay packed%s\n", RED, PACK_FILE, RESET);
+				else
+					freed = before - (stat(PACK_FILE, &st) == 0 ? (uint64_t)st.st_size : 0);
+			}
+			for (i = 0; i < n; i++)
+			{
+				if (!items[i].drop)
+					continue;
+				snprintf(path, sizeof(path), "%s/%s.%d", BACKUP_DIR, items[i].name, items[i].version);
+				if (items[i].loose && unlink(path) == 0)
+					freed += items[i].bytes;
+			}
+			say("%sPruned %d of %d versions across %d files, %llu bytes, %llu stored bytes freed%s\n",
+				GREEN, dropped, n, files, (unsigned long long)bytes, (unsigned long long)freed, RESET);
+		}
+	}
+
+	free(drop);
+	free(items);
+	free(pins.keys);
+	free(gone.keys);
+	strmap_clear(&names, 0);
+	return result;
+}
+
+/* the id of the newest snapshot, 0 if there is none */
+int
+snapshot_last(void)
+{
+	Snapshot last;
+	FILE *fp = fopen(SNAPSHOT_FILE, "rb");
+	int id = 0;
+
+	if (!fp)
+		return 0;
+	if (fseek(fp, -(long)sizeof(Snapshot), SEEK_END) == 0 &&
+		fread(&last, sizeof(Snapshot), 1, fp) == 1)
+		id = last.id;
+	fclose(fp);
+	return id;
+}
+
+/* reads MOVES_FILE into the arena; lines written before moves carried a
+ * snapshot apply to every snapshot */
+ErrorCode
+moves_load(Moves *moves)
+{
+	char line[MAX_PATH * 2 + 16];
+	char *to, *after;
+	ErrorCode result = SUCCESS;
+	Move *m;
+	FILE *fp;
+	int cap = 0;
+
+	moves->list = NULL;
+	moves->count = 0;
+	if (!(fp = fopen(MOVES_FILE, "r")))
+		return SUCCESS;
+	while (result == SUCCESS && fgets(line, sizeof(line), fp))
+	{
+		line[strcspn(line, "\n")] = '\0';
+		if (!(to = strchr(line, '\t')))
+			continue;
+		*to++ = '\0';
+		if ((after = strchr(to, '\t')))
+			*after++ = '\0';
+		if (moves->count == cap)
+		{
+			Move *grown = arena_alloc((cap = cap ? cap * 2 : 64) * sizeof(Move));
+
+			if (!grown)
+			{
+				result = ERR_NO_MEMORY;
+				break;
+			}
+			if (moves->count)
+				memcpy(grown, moves->list, moves->count * sizeof(Move));
+			moves->list = grown;
+		}
+		m = &moves->list[moves->count];
+		if (!(m->from = arena_alloc(strlen(line) + 1)) || !(m->to = arena_alloc(strlen(to) + 1)))
+		{
+			result = ERR_NO_MEMORY;
+			break;
+		}
+		strcpy(m->from, line);
+		strcpy(m->to, to);
+		m->after = after ? atoi(after) : INT_MAX;
+		moves->count++;
+	}
+	fclose(fp);
+	return result;
+}
+
+/* the name a file of snapshot snap has now: the moves made after that
+ * snapshot, followed in the order they were made */
+const char *
+move_follow(const Moves *moves, const char *name, int snap)
+{
+	int k;
+
+	for (k = 0; k < moves->count; k++)
+		if (snap <= moves->list[k].after && strcmp(moves->list[k].from, name) == 0)
+			name = moves->list[k].to;
+	return name;
+}
+
+static int
+pack_slot_cmp(const void *a, const void *b)
+{
+	const PackSlot *x = a, *y = b;
+	int cmp = strcmp(x->name, y->name);
+
+	return cmp ? cmp : (int)x->entry.version - (int)y->entry.version;
+}
+
+/* where a name ends up after the moves, taken in order */
+static const char *
+rename_follow(const char *name, const char **from, const char **to, int n)
+{
+	int k;
+
+	for (k = 0; k < n; k++)
+		if (strcmp(name, from[k]) == 0)
+			name = to[k];
+	return name;
+}
+
+/* renames packed versions by appending a rebuilt index to the pack: the
+ * object data is neither copied nor moved, and the old index stays behind
+ * as dead space until gc next rewrites the pack. A torn append leaves
+ * the old trailer for pack_open to fall back to. */
+ErrorCode
+pack_rename(const char **from, const char **to, int n)
+{
+	PackTrailer trailer;
+	PackSlot *slots;
+	struct stat st;
+	char *names = NULL, *index = NULL;
+	size_t names_len = 0, names_cap = 0, index_len;
+	int *map, count, i, fd, changed = 0;
+	ErrorCode result = SUCCESS;
+
+	if (pack_open() != 0)
+		return SUCCESS;
+	count = pack.count;
+	slots = malloc(count * sizeof(PackSlot));
+	map = malloc(count * sizeof(int));
+	if (!slots || !map)
+	{
+		free(slots);
+		free(map);
+		return ERR_NO_MEMORY;
+	}
+	for (i = 0; i < count; i++)
+	{
+		const char *name = pack.names + pack.entries[i].name;
+
+		/* entries are sorted by name, so each name is followed once */
+		if (i > 0 && pack.entries[i].name == pack.entries[i - 1].name)
+			slots[i].name = slots[i - 1].name;
+		else
+			slots[i].name = rename_follow(name, from, to, n);
+		changed |= slots[i].name != name;
+		slots[i].entry = pack.entries[i];
+		slots[i].old = i;
+	}
+	if (!changed)
+	{
+		free(slots);
+		free(map);
+		return SUCCESS;
+	}
+
+	qsort(slots, count, sizeof(PackSlot), pack_slot_cmp);
+	for (i = 0; i < count; i++)
+		map[slots[i].old] = i;
+
+	for (i = 0; i < count; i++)
+	{
+		PackEntry *e = &slots[i].entry;
+
+		if (e->base >= 0)
+			e->base = map[e->base];
+		if (i > 0 && strcmp(slots[i].name, slots[i - 1].name) == 0)
+		{
+			e->name = slots[i - 1].entry.name;
+			continue;
+		}
+
+		size_t len = strlen(slots[i].name) + 1;
+		if (names_len + len > names_cap)
+			names = realloc(names, names_cap = (names_len + len) * 2);
+		memcpy(names + names_len, slots[i].name, len);
+		e->name = names_len;
+		names_len += len;
+	}
+
+	index_len = count * sizeof(PackEntry) + names_len;
+	fd = open(PACK_FILE, O_WRONLY | O_APPEND);
+	if (!(index = malloc(index_len)) || fd < 0 || fstat(fd, &st) != 0)
+	{
+		result = ERR_IO;
+	}
+	else
+	{
+		/* the index is used in place through the map, so it is aligned */
+		static const char pad[__alignof__(PackEntry)];
+		size_t gap = -st.st_size & (__alignof__(PackEntry) - 1);
+
+		for (i = 0; i < count; i++)
+			memcpy(index + i * sizeof(PackEntry), &slots[i].entry, sizeof(PackEntry));
+		memcpy(index + count * sizeof(PackEntry), names, names_len);
+
+		memset(&trailer, 0, sizeof(trailer));
+		trailer.index = st.st_size + gap;
+		trailer.sum = xxh64(index, index_len, 0);
+		trailer.count = count;
+		trailer.names = names_len;
+		memcpy(trailer.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+		if (write_all(fd, pad, gap) != 0 || write_all(fd, index, index_len) != 0 ||
+			write_all(fd, &trailer, sizeof(PackTrailer)) != 0 || fdatasync(fd) != 0)
+			result = ERR_IO;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	free(index);
+	free(names);
+	free(slots);
+	free(map);
+	return result;
+}
+
+/* moves every trace of a batch of files to their new names in one pass
+ * over each store: history records and index entries are patched in
+ * place, loose versions renamed and the pack gets a new index, so nothing
+ * is copied. Moves apply in order, and each step skips what is already
+ * done, which makes replay safe. */
+ErrorCode
+rename_apply(const char **from, const char **to, int n)
+{
+	char name[MAX_PATH], field[MAX_PATH], path[MAX_PATH * 2], dest[MAX_PATH * 2];
+	const size_t at = offsetof(EnhancedVersionInfo, filename);
+	const size_t ver = offsetof(EnhancedVersionInfo, version);
+	EnhancedVersionInfo *info = new_record();
+	StrMap involved = {0}, moves = {0};
+	ErrorCode result = SUCCESS;
+	struct
+	{
+		off_t off;
+		int version;
+		const char *name;
+		const char *cur;
+	} *recs = NULL;
+	size_t nrecs = 0;
+	uint64_t sum;
+	off_t off;
+	FILE *fp;
+	int fd, sums, version, k, *slot;
+
+	if (!info)
+		return ERR_NO_MEMORY;
+	for (k = 0; k < n; k++)
+	{
+		strmap_put(&involved, (char *)from[k], 2 * k);
+		strmap_put(&involved, (char *)to[k], 2 * k + 1);
+	}
+
+	if ((fd = open(HISTORY_FILE, O_RDWR)) >= 0)
+	{
+		/* one scan collects every record of a file being moved */
+		for (off = 0; pread(fd, name, MAX_PATH, off + at) == MAX_PATH; off += sizeof(EnhancedVersionInfo))
+		{
+			name[MAX_PATH - 1] = '\0';
+			if (!(slot = strmap_get(&involved, name)))
+				continue;
+			if (pread(fd, &version, sizeof(int), off + ver) != sizeof(int))
+				break;
+			if (!(nrecs & (nrecs - 1)))
+			{
+				void *grown = realloc(recs, (nrecs ? nrecs * 2 : 16) * sizeof(*recs));
+
+				if (!grown)
+				{
+					result = ERR_NO_MEMORY;
+					nrecs = 0;
+					break;
+				}
+				recs = grown;
+			}
+			recs[nrecs].off = off;
+			recs[nrecs].version = version;
+			recs[nrecs].name = *slot & 1 ? to[*slot / 2] : from[*slot / 2];
+			recs[nrecs].cur = recs[nrecs].name;
+			nrecs++;
+		}
+
+		/* loose versions follow each move in turn, also for records a
+		 * previous attempt already patched */
+		for (k = 0; k < n; k++)
+		{
+			for (size_t r = 0; r < nrecs; r++)
+			{
+				int moved = strcmp(recs[r].cur, from[k]) == 0;
+
+				if (!moved && strcmp(recs[r].cur, to[k]) != 0)
+					continue;
+				if (moved)
+					recs[r].cur = to[k];
+				snprintf(path, sizeof(path), "%s/%s.%d", BACKUP_DIR, from[k], recs[r].version);
+				snprintf(dest, sizeof(dest), "%s/%s.%d", BACKUP_DIR, to[k], recs[r].version);
+				if (access(path, F_OK) == 0)
+				{
+					make_parents(dest);
+					if (rename(path, dest) != 0)
+						result = ERR_IO;
+				}
+			}
+		}
+
+		sums = sums_open();
+		for (size_t r = 0; r < nrecs; r++)
+		{
+			if (recs[r].cur != recs[r].name)
+			{
+				memset(field, 0, sizeof(field));
+				memcpy(field, recs[r].cur, strnlen(recs[r].cur, MAX_PATH - 1));
+				if (pwrite(fd, field, MAX_PATH, recs[r].off + at) != MAX_PATH)
+					result = ERR_IO;
+			}
+
+			/* the record changed under its checksum; the content did not */
+			if (sums >= 0 && pread(fd, info, sizeof(EnhancedVersionInfo), recs[r].off) ==
+				sizeof(EnhancedVersionInfo))
+			{
+				sum = xxh64(info, sizeof(EnhancedVersionInfo), 0);
+				if (pwrite(sums, &sum, sizeof(uint64_t), sizeof(SumsHeader) +
+						   recs[r].off / sizeof(EnhancedVersionInfo) * sizeof(VersionSum)) != sizeof(uint64_t))
+					result = ERR_IO;
+			}
+		}
+		if (fdatasync(fd) != 0 || (sums >= 0 && fdatasync(sums) != 0))
+			result = ERR_IO;
+		if (sums >= 0)
+			close(sums);
+		close(fd);
+	}
+	free(recs);
+
+	if ((fd = open(INDEX_FILE, O_RDWR)) >= 0)
+	{
+		for (off = 0; pread(fd, name, MAX_PATH, off) == MAX_PATH; off += sizeof(TrackedFile))
+		{
+			const char *dst;
+
+			name[MAX_PATH - 1] = '\0';
+			if (!strmap_get(&involved, name) || (dst = rename_follow(name, from, to, n)) == name)
+				continue;
+			memset(field, 0, sizeof(field));
+			memcpy(field, dst, strnlen(dst, MAX_PATH - 1));
+			if (pwrite(fd, field, MAX_PATH, off) != MAX_PATH)
+				result = ERR_IO;
+		}
+		if (fdatasync(fd) != 0)
+			result = ERR_IO;
+		close(fd);
+	}
+	strmap_clear(&involved, 0);
+
+	if (pack_rename(from, to, n) != SUCCESS)
+		result = ERR_IO;
+
+	if ((fp = fopen(MOVES_FILE, "a+")))
+	{
+		char line[MAX_PATH * 2 + 16], *copy;
+		int after = snapshot_last();
+
+		/* moves already listed by a previous attempt are not repeated */
+		rewind(fp);
+		while (fgets(line, sizeof(line), fp))
+		{
+			line[strcspn(line, "\n")] = '\0';
+			if (!strmap_get(&moves, line) && (copy = strdup(line)))
+				strmap_put(&moves, copy, 1);
+		}
+		for (k = 0; k < n; k++)
+		{
+			snprintf(line, sizeof(line), "%s\t%s\t%d", from[k], to[k], after);
+			if (!strmap_get(&moves, line))
+				fprintf(fp, "%s\n", line);
+		}
+		if (fflush(fp) != 0 || fdatasync(fileno(fp)) != 0)
+			result = ERR_IO;
+		fclose(fp);
+	}
+	strmap_clear(&moves, 1);
+
+	/* the time index is keyed by name */
+	unlink(TIME_INDEX);
+	return result;
+}
+
+/* ERR_FILE_EXISTS if earlier moves lead from to back to from */
+static ErrorCode
+mv_cycle(const char *from, const char *to)
+{
+	ArenaMark mark = arena_mark();
+	StrMap reach = {0};
+	Moves moves;
+	int grew = 1, k;
+	ErrorCode result;
+
+	if ((result = moves_load(&moves)) != SUCCESS)
+		return result;
+	strmap_put(&reach, (char *)to, 1);
+	while (grew && !strmap_get(&reach, from))
+	{
+		grew = 0;
+		for (k = 0; k < moves.count; k++)
+		{
+			if (strmap_get(&reach, moves.list[k].from) && !strmap_get(&reach, moves.list[k].to))
+			{
+				strmap_put(&reach, moves.list[k].to, 1);
+				grew = 1;
+			}
+		}
+	}
+	result = strmap_get(&reach, from) ? ERR_FILE_EXISTS : SUCCESS;
+	strmap_clear(&reach, 0);
+	arena_reset(mark);
+	return result;
+}
+
+/* whether a tracked file's history can move to a new name */
+static ErrorCode
+mv_check(const char *from, const char *to)
+{
+	ErrorCode result;
+
+	if (!is_tracked(from))
+		return ERR_FILE_NOT_TRACKED;
+	if (is_tracked(to) || latest_version(to) > 0)
+	{
+		say("%s%s already has history%s\n", RED, to, RESET);
+		return ERR_FILE_EXISTS;
+	}
+	if (strlen(from) >= MAX_PATH || strlen(to) >= MAX_PATH || strchr(from, '\t') || strchr(to, '\t'))
+		return ERR_NO_FILE;
+	if ((result = mv_cycle(from, to)) == ERR_FILE_EXISTS)
+		say("%s%s was moved to %s before; moving it back would make the moves circular%s\n",
+			RED, to, from, RESET);
+	return result;
+}
+
+/* queues the move of a tracked file's history to a new name */
+ErrorCode
+mv_record(const char *from, const char *to)
+{
+	size_t flen = strlen(from) + 1, tlen = strlen(to) + 1;
+	ErrorCode result;
+	char *payload;
+
+	if ((result = mv_check(from, to)) != SUCCESS)
+		return result;
+	if (!(payload = arena_alloc(flen + tlen)))
+		return ERR_NO_MEMORY;
+
+	memcpy(payload, from, flen);
+	memcpy(payload + flen, to, tlen);
+	wal_append(WAL_RENAME, payload, flen + tlen);
+	say("%sMoved %s -> %s with its history%s\n", GREEN, from, to, RESET);
+	return SUCCESS;
+}
+
+/* moves the working file too unless that already happened, but only
+ * once the history is known to be able to follow */
+ErrorCode
+mv(const char *from, const char *to)
+{
+	ErrorCode result;
+
+	if (lock_store(F_WRLCK) != 0)
+		return ERR_IO;
+	if ((result = mv_check(from, to)) != SUCCESS)
+		return result;
+
+	if (access(from, F_OK) == 0)
+	{
+		if (access(to, F_OK) == 0)
+			return ERR_FILE_EXISTS;
+		make_parents(to);
+		if (rename(from, to) != 0)
+		{
+			say("%sCannot move %s: %s%s\n", RED, from, strerror(errno), RESET);
+			return ERR_IO;
+		}
+	}
+	else if (access(to, F_OK) != 0)
+	{
+		return ERR_NO_FILE;
+	}
+	return mv_record(from, to);
+}
+
+static int
+uint64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* sorted hashes of every line, for a cheap similarity score */
+static uint64_t *
+line_hashes(const Blob *blob, size_t *n)
+{
+	const char *p = blob->data, *end = blob->data + blob->len, *nl;
+	uint64_t *lines;
+	size_t cap = 64;
+
+	*n = 0;
+	if (!(lines = malloc(cap * sizeof(uint64_t))))
+		return NULL;
+	for (; p < end; p = nl + 1)
+	{
+		if (!(nl = memchr(p, '\n', end - p)))
+			nl = end;
+		if (*n == cap && !(lines = realloc(lines, (cap *= 2) * sizeof(uint64_t))))
+			return NULL;
+		lines[(*n)++] = xxh64(p, nl - p, 0);
+	}
+	qsort(lines, *n, sizeof(uint64_t), uint64_cmp);
+	return lines;
+}
+
+/* percentage of lines two files share */
+static int
+similarity(const uint64_t *a, size_t na, const uint64_t *b, size_t nb)
+{
+	size_t i = 0, j = 0, common = 0;
+
+	if (na + nb == 0)
+		return 0;
+	while (i < na && j < nb)
+	{
+		if (a[i] == b[j])
+			common++, i++, j++;
+		else if (a[i] < b[j])
+			i++;
+		else
+			j++;
+	}
+	return (int)(200 * common / (na + nb));
+}
+
+static void
+collect_untracked(const char *dir, StrMap *tracked, RenameCandidate **list, int *n, int *cap)
+{
+	char path[MAX_PATH];
+	struct dirent *entry;
+	struct stat st;
+	DIR *d;
+
+	if (!(d = opendir(dir)))
+		return;
+	while ((entry = readdir(d)))
+	{
+		char *copy;
+
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+			strcmp(entry->d_name, VCS_DIR) == 0 || strcmp(entry->d_name, IMPORT_DIR) == 0)
+			continue;
+		if (strcmp(dir, ".") == 0)
+			snprintf(path, sizeof(path), "%s", entry->d_name);
+		else
+			snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		if (lstat(path, &st) != 0)
+			continue;
+		if (S_ISDIR(st.st_mode))
+		{
+			collect_untracked(path, tracked, list, n, cap);
+			continue;
+		}
+		if (!S_ISREG(st.st_mode) || strmap_get(tracked, path))
+			continue;
+		if (*n == *cap && !(*list = realloc(*list, (*cap = *cap ? *cap * 2 : 64) * sizeof(RenameCandidate))))
+			break;
+		if (!(copy = arena_alloc(strlen(path) + 1)))
+			break;
+		memset(&(*list)[*n], 0, sizeof(RenameCandidate));
+		(*list)[*n].path = strcpy(copy, path);
+		(*list)[(*n)++].size = st.st_size;
+	}
+	closedir(d);
+}
+
+/* whether an untracked file may take a missing file's name, which it may
+ * not while it still has history of its own */
+static int
+rename_free(RenameCandidate *cand)
+{
+	if (!cand->checked)
+	{
+		cand->checked = 1;
+		if (latest_version(cand->path) > 0)
+			cand->taken = 1;
+	}
+	return !cand->taken;
+}
+
+/* pairs tracked files that vanished with untracked files holding the same
+ * content, or failing that the most similar one; the tree is only walked
+ * when something is missing, and only candidates whose size could match
+ * are read. Strings live in the arena. */
+int
+detect_renames(Rename **renames)
+{
+	RenameCandidate *cand = NULL;
+	TrackedFile file;
+	StrMap tracked = {0};
+	HashSet sizes = {0};
+	const char **missing = NULL;
+	uint64_t *msize = NULL, *msum = NULL, key;
+	struct stat st;
+	Blob blob;
+	FILE *fp;
+	int nmissing = 0, ncand = 0, cap = 0, count = 0, i, j;
+
+	*renames = NULL;
+	if (!(fp = fopen(INDEX_FILE, "rb")))
+		return 0;
+	while (fread(&file, sizeof(TrackedFile), 1, fp) == 1)
+	{
+		char *path;
+
+		if (!file.is_tracked || strmap_get(&tracked, file.path) ||
+			!(path = arena_alloc(strlen(file.path) + 1)))
+			continue;
+		strmap_put(&tracked, strcpy(path, file.path), 1);
+		if (stat(path, &st) == 0)
+			continue;
+		if (!(nmissing & (nmissing - 1)))
+			missing = realloc(missing, (nmissing ? nmissing * 2 : 16) * sizeof(char *));
+		missing[nmissing++] = path;
+	}
+	fclose(fp);
+
+	if (nmissing > 0 && (msize = malloc(nmissing * sizeof(uint64_t))) &&
+		(msum = malloc(nmissing * sizeof(uint64_t))))
+	{
+		for (i = 0; i < nmissing; i++)
+		{
+			ArenaMark mark = arena_mark();
+
+			if (load_version(missing[i], latest_version(missing[i]), &blob) == SUCCESS)
+			{
+				msize[i] = blob.len;
+				msum[i] = xxh64(blob.data, blob.len, 0);
+				hashset_add(&sizes, xxh64(&msize[i], sizeof(uint64_t), 0));
+			}
+			else
+			{
+				missing[i] = NULL;
+			}
+			arena_reset(mark);
+		}
+		collect_untracked(".", &tracked, &cand, &ncand, &cap);
+	}
+	if (msum && ncand > 0)
+		*renames = arena_alloc(nmissing * sizeof(Rename));
+
+	/* only a file of the same size can hold the same content */
+	for (j = 0; *renames && j < ncand; j++)
+	{
+		ArenaMark mark = arena_mark();
+
+		key = cand[j].size;
+		if (hashset_has(&sizes, xxh64(&key, sizeof(uint64_t), 0)) &&
+			read_blob(cand[j].path, &blob) == SUCCESS)
+			cand[j].sum = xxh64(blob.data, blob.len, 0);
+		arena_reset(mark);
+	}
+
+	/* exact content first, then the best line overlap */
+	for (int pass = 0; *renames && pass < 2; pass++)
+	{
+		for (i = 0; i < nmissing; i++)
+		{
+			ArenaMark mark = arena_mark();
+			uint64_t *lines = NULL;
+			size_t nlines = 0;
+			int best, score, s;
+
+			if (!missing[i])
+				continue;
+			if (pass == 1)
+			{
+				if (load_version(missing[i], latest_version(missing[i]), &blob) == SUCCESS)
+					lines = line_hashes(&blob, &nlines);
+				arena_reset(mark);
+				if (!lines)
+					continue;
+			}
+
+			/* the pick is only checked for history of its own, and passed
+			 * over if it has some */
+			do
+			{
+				best = -1, score = 0;
+				for (j = 0; j < ncand; j++)
+				{
+					if (cand[j].taken)
+						continue;
+					if (pass == 0)
+					{
+						if ((uint64_t)cand[j].size == msize[i] && cand[j].sum == msum[i])
+						{
+							best = j, score = 100;
+							break;
+						}
+						continue;
+					}
+					/* sizes too far apart cannot reach the threshold */
+					if ((uint64_t)cand[j].size * 3 < msize[i] || msize[i] * 3 < (uint64_t)cand[j].size)
+						continue;
+					if (!cand[j].lines)
+					{
+						ArenaMark cmark = arena_mark();
+						Blob other;
+
+						if (read_blob(cand[j].path, &other) == SUCCESS)
+							cand[j].lines = line_hashes(&other, &cand[j].nlines);
+						arena_reset(cmark);
+					}
+					if (cand[j].lines &&
+						(s = similarity(lines, nlines, cand[j].lines, cand[j].nlines)) > score)
+						best = j, score = s;
+				}
+			} while (best >= 0 && score >= RENAME_SCORE && !rename_free(&cand[best]));
+			free(lines);
+
+			if (best >= 0 && score >= RENAME_SCORE)
+			{
+				(*renames)[count].from = missing[i];
+				(*renames)[count].to = cand[best].path;
+				(*renames)[count++].score = score;
+				cand[best].taken = 1;
+				missing[i] = NULL;
+			}
+		}
+	}
+
+	for (j = 0; j < ncand; j++)
+		free(cand[j].lines);
+	free(cand);
+	free(missing);
+	free(msize);
+	free(msum);
+	free(sizes.keys);
+	strmap_clear(&tracked, 0);
+	return count;
+}
+
+void
+status_renames(void)
+{
+	Rename *renames;
+	int n = detect_renames(&renames), i;
+
+	if (n == 0)
+		return;
+	say("%sRenamed (record with 'ew mv' or 'ew save --all-modified'):%s\n", YELLOW, RESET);
+	for (i = 0; i < n; i++)
+		say(" %s%s -> %s (%d%%)%s\n", CYAN, renames[i].from, renames[i].to, renames[i].score, RESET);
+}
+
+/* records the renames status would report, then saves every tracked
+ * file whose content differs from its latest version */
+ErrorCode
+save_all(void)
+{
+	Rename *renames;
+	TrackedFile file;
+	StrMap seen = {0};
+	ErrorCode result = SUCCESS;
+	FILE *fp;
+	int n, moved = 0, saved = 0, i;
+
+	if (lock_store(F_WRLCK) != 0)
+		return ERR_IO;
+
+	/* a pair that cannot be recorded is left for the user, not fatal */
+	n = detect_renames(&renames);
+	for (i = 0; i < n; i++)
+		if (mv_record(renames[i].from, renames[i].to) == SUCCESS)
+			moved++;
+	/* the saves below need the new names in place */
+	if (moved && wal_commit() != SUCCESS)
+		return ERR_IO;
+	if (moved && repo->cache.loaded)
+		cache_load();
+
+	if (!(fp = fopen(INDEX_FILE, "rb")))
+		return SUCCESS;
+	while (result == SUCCESS && fread(&file, sizeof(TrackedFile), 1, fp) == 1)
+	{
+		ArenaMark mark = arena_mark();
+		Blob current, stored;
+		char *path;
+		int latest;
+
+		if (!file.is_tracked || strmap_get(&seen, file.path) || access(file.path, F_OK) != 0)
+			continue;
+		if ((path = strdup(file.path)))
+			strmap_put(&seen, path, 1);
+
+		latest = latest_version(file.path);
+		if (latest < 1 || load_version(file.path, latest, &stored) != SUCCESS ||
+			read_blob(file.path, &current) != SUCCESS || current.len != stored.len ||
+			memcmp(current.data, stored.data, stored.len) != 0)
+		{
+			arena_reset(mark);
+			if ((result = save(file.path)) == SUCCESS)
+				saved++;
+		}
+		arena_reset(mark);
+	}
+	fclose(fp);
+	strmap_clear(&seen, 1);
+
+	say("%sSaved %d modified files, recorded %d renames%s\n", GREEN, saved, moved, RESET);
+	return result;
+}
+
+/* accepts epoch seconds (@N), "N[smhd] [ago]" relative to now and
+ * "YYYY-MM-DD[ HH:MM[:SS]]" or "HH:MM" in local time */
+int
+parse_time(const char *s, time_t *t)
+{
+	static const char *formats[] = {
+		"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M:%S",
+		"%Y-%m-%d", NULL
+	};
+	struct tm tm;
+	const char *end;
+	char *unit;
+	long n;
+	int i;
+
+	if (*s == '@')
+	{
+		*t = strtoll(s + 1, &unit, 10);
+		return *unit ? -1 : 0;
+	}
+
+	for (i = 0; formats[i]; i++)
+	{
+		memset(&tm, 0, sizeof(tm));
+		if ((end = strptime(s, formats[i], &tm)) && *end == '\0')
+		{
+			tm.tm_isdst = -1;
+			*t = mktime(&tm);
+			return 0;
+		}
+	}
+
+	memset(&tm, 0, sizeof(tm));
+	if ((end = strptime(s, "%H:%M", &tm)) && *end == '\0')
+	{
+		time_t now = time(NULL);
+		int hour = tm.tm_hour, min = tm.tm_min;
+
+		localtime_r(&now, &tm);
+		tm.tm_hour = hour;
+		tm.tm_min = min;
+		tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		*t = mktime(&tm);
+		return 0;
+	}
+
+	n = strtol(*s == '-' ? s + 1 : s, &unit, 10);
+	if (unit == s || n < 0)
+		return -1;
+	while (*unit == ' ')
+		unit++;
+	switch (*unit)
+	{
+	case 's': break;
+	case 'm': n *= 60; break;
+	case 'h': n *= 3600; break;
+	case 'd': n *= 86400; break;
+	default: return -1;
+	}
+	*t = time(NULL) - n;
+	return 0;
+}
+
+static int
+time_entry_cmp(const void *a, const void *b)
+{
+	const TimeEntry *x = a, *y = b;
+
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	if (x->timestamp != y->timestamp)
+		return x->timestamp < y->timestamp ? -1 : 1;
+	return x->version - y->version;
+}
+
+/* loads TIME_INDEX into the arena, first indexing any history records
+ * added since it was written; a rewritten history is indexed from scratch */
+ErrorCode
+time_index_load(TimeIndex *idx)
+{
+	EnhancedVersionInfo *info = new_record();
+	TimeHeader header;
+	struct stat st;
+	char tmp[MAX_PATH];
+	uint64_t total, i;
+	FILE *fp;
+	int fd;
+
+	memset(&header, 0, sizeof(TimeHeader));
+	if (!info || stat(HISTORY_FILE, &st) != 0)
+		return ERR_NO_HISTORY;
+	total = st.st_size / sizeof(EnhancedVersionInfo);
+
+	if ((fp = fopen(TIME_INDEX, "rb")))
+	{
+		if (fread(&header, sizeof(TimeHeader), 1, fp) != 1 ||
+			memcmp(header.magic, TIME_MAGIC, sizeof(TIME_MAGIC)) != 0 ||
+			header.ino != (uint64_t)st.st_ino || header.records > total)
+			header.records = 0;
+	}
+
+	if (!(idx->entries = arena_alloc((total + 1) * sizeof(TimeEntry))))
+	{
+		if (fp)
+			fclose(fp);
+		return ERR_NO_MEMORY;
+	}
+	idx->count = 0;
+	if (fp && header.records > 0)
+		idx->count = fread(idx->entries, sizeof(TimeEntry), header.records, fp);
+	if (fp)
+		fclose(fp);
+	if (idx->count != header.records)
+		idx->count = header.records = 0;
+
+	if (header.records == total)
+		return SUCCESS;
+
+	if (!(fp = fopen(HISTORY_FILE, "rb")))
+		return ERR_NO_HISTORY;
+	fseeko(fp, (off_t)header.records * sizeof(EnhancedVersionInfo), SEEK_SET);
+	for (i = header.records; i < total && fread(info, sizeof(EnhancedVersionInfo), 1, fp) == 1; i++)
+	{
+		TimeEntry *e = &idx->entries[idx->count++];
+		e->key = xxh64(info->filename, strlen(info->filename), 0);
+		e->timestamp = info->timestamp;
+		e->record = i;
+		e->version = info->version;
+	}
+	fclose(fp);
+	qsort(idx->entries, idx->count, sizeof(TimeEntry), time_entry_cmp);
+
+	/* best effort: a stale or missing index only costs a rescan */
+	memcpy(header.magic, TIME_MAGIC, sizeof(TIME_MAGIC));
+	header.records = i;
+	header.ino = st.st_ino;
+	snprintf(tmp, sizeof(tmp), "%s.%d", TIME_INDEX, (int)getpid());
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0)
+	{
+		if (write_all(fd, &header, sizeof(TimeHeader)) == 0 &&
+			write_all(fd, idx->entries, idx->count * sizeof(TimeEntry)) == 0 &&
+			close(fd) == 0)
+			rename(tmp, TIME_INDEX);
+		else
+			unlink(tmp);
+	}
+	return SUCCESS;
+}
+
+/* newest version of filename saved at or before t, 0 if none */
+int
+version_at(TimeIndex *idx, const char *filename, time_t t)
+{
+	char name[MAX_PATH];
+	uint64_t key = xxh64(filename, strlen(filename), 0);
+	int64_t lo = 0, hi = (int64_t)idx->count - 1, mid, found = -1;
+	int fd;
+
+	while (lo <= hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (idx->entries[mid].key < key ||
+			(idx->entries[mid].key == key && idx->entries[mid].timestamp <= t))
+		{
+			if (idx->entries[mid].key == key)
+				found = mid;
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+
+	/* hashes can collide: confirm the name against the history record */
+	if ((fd = open(HISTORY_FILE, O_RDONLY)) < 0)
+		return 0;
+	for (; found >= 0 && idx->entries[found].key == key; found--)
+	{
+		if (pread(fd, name, MAX_PATH, (off_t)idx->entries[found].record *
+				  sizeof(EnhancedVersionInfo)) == MAX_PATH &&
+			strncmp(name, filename, MAX_PATH) == 0)
+		{
+			close(fd);
+			return idx->entries[found].version;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+/* restores every tracked file under paths (all when none are given) to
+ * its version as of t, spreading the files over one worker per CPU */
+ErrorCode
+revert_at(time_t t, char **paths, int npaths)
+{
+	TimeIndex idx;
+	TreeItem *items = NULL;
+	TrackedFile file;
+	FILE *fp;
+	int *counts, single[3], n = 0, workers, w, i, j, missing = 0, failed = 0;
+	int (*pipes)[2];
+	size_t counts_size;
+	char time_str[26];
+	ErrorCode result;
+
+	if (lock_store(F_RDLCK) != 0)
+		return ERR_IO;
+	if ((result = time_index_load(&idx)) != SUCCESS)
+	{
+		if (result == ERR_NO_MEMORY)
+			out_of_memory();
+		else
+			say("%sNo history found%s\n", RED, RESET);
+		return result;
+	}
+
+	if ((fp = fopen(INDEX_FILE, "rb")))
+	{
+		while (fread(&file, sizeof(TrackedFile), 1, fp) == 1)
+		{
+			int match = npaths == 0;
+			char *path;
+
+			for (j = 0; j < npaths && !match; j++)
+			{
+				size_t l = strlen(paths[j]);
+				while (l > 1 && paths[j][l - 1] == '/')
+					l--;
+				match = strcmp(file.path, paths[j]) == 0 ||
+					(strncmp(file.path, paths[j], l) == 0 && file.path[l] == '/') ||
+					strcmp(paths[j], ".") == 0;
+			}
+			if (!match || !file.is_tracked)
+				continue;
+
+			if (!(n & (n - 1)))
+			{
+				TreeItem *grown = realloc(items, (n ? n * 2 : 64) * sizeof(TreeItem));
+
+				if (!grown)
+				{
+					out_of_memory();
+					free(items);
+					fclose(fp);
+					return ERR_NO_MEMORY;
+				}
+				items = grown;
+			}
+			if (!(path = arena_alloc(strlen(file.path) + 1)))
+			{
+				out_of_memory();
+				free(items);
+				fclose(fp);
+				return ERR_NO_MEMORY;
+			}
+			items[n].path = strcpy(path, file.path);
+			if ((items[n].version = version_at(&idx, path, t)) == 0)
+				missing++;
+			else
+				n++;
+		}
+		fclose(fp);
+	}
+
+	ctime_r(&t, time_str);
+	time_str[24] = '\0';
+	if (n == 0)
+	{
+		say("%sNo tracked files had a saved version at %s%s\n", YELLOW, time_str, RESET);
+		free(items);
+		return SUCCESS;
+	}
+
+	workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1)
+		workers = 1;
+	if (workers > n)
+		workers = n;
+
+	/* per worker: rewritten, unchanged, failed */
+	counts_size = workers * 3 * sizeof(int);
+	counts = mmap(NULL, counts_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (counts == MAP_FAILED)
+	{
+		counts = single;
+		workers = 1;
+	}
+	if (!(pipes = malloc(workers * sizeof(*pipes))))
+		workers = 1;
+	fflush(stdout);
+
+	for (w = 0; w < workers; w++)
+	{
+		pid_t pid = -1;
+
+		if (workers > 1 && pipe(pipes[w]) == 0)
+		{
+			if ((pid = fork()) > 0)
+			{
+				close(pipes[w][1]);
+				continue;
+			}
+			if (pid < 0)
+			{
+				close(pipes[w][0]);
+				close(pipes[w][1]);
+			}
+		}
+		if (pid == 0)
+		{
+			/* messages go up the pipe for the parent to pass on */
+			close(pipes[w][0]);
+			dup2(pipes[w][1], STDOUT_FILENO);
+			close(pipes[w][1]);
+			repo->output = NULL;
+		}
+		else if (workers > 1)
+		{
+			/* no fork: this slice runs in the parent */
+			pipes[w][0] = -1;
+		}
+
+		int done[3] = {0};
+		for (i = w; i < n; i += workers)
+		{
+			ArenaMark mark = arena_mark();
+			Blob current, stored;
+
+			if (load_version(items[i].path, items[i].version, &stored) != SUCCESS)
+			{
+				say("%sCannot load version %d of %s%s\n", RED, items[i].version, items[i].path, RESET);
+				done[2]++;
+			}
+			else if (read_blob(items[i].path, &current) == SUCCESS && current.len == stored.len &&
+					 memcmp(current.data, stored.data, stored.len) == 0)
+			{
+				done[1]++;
+			}
+			else if (write_blob(items[i].path, &stored) == SUCCESS)
+			{
+				say(" %s%s (version %d)%s\n", GREEN, items[i].path, items[i].version, RESET);
+				done[0]++;
+			}
+			else
+			{
+				say("%sError writing %s%s\n", RED, items[i].path, RESET);
+				done[2]++;
+			}
+			arena_reset(mark);
+		}
+		memcpy(counts + w * 3, done, sizeof(done));
+		if (pid == 0)
+		{
+			fflush(stdout);
+			_exit(0);
+		}
+	}
+
+	for (w = 0; workers > 1 && w < workers; w++)
+	{
+		char buf[65536];
+		ssize_t len;
+
+		if (pipes[w][0] < 0)
+			continue;
+		fflush(stdout);
+		while ((len = read(pipes[w][0], buf, sizeof(buf))) > 0)
+			emit(buf, len);
+		close(pipes[w][0]);
+	}
+	while (workers > 1 && wait(NULL) > 0)
+		;
+	free(pipes);
+
+	int rewritten = 0, unchanged = 0;
+	for (w = 0; w < workers; w++)
+	{
+		rewritten += counts[w * 3];
+		unchanged += counts[w * 3 + 1];
+		failed += counts[w * 3 + 2];
+	}
+	if (counts != single)
+		munmap(counts, counts_size);
+	free(items);
+
+	say("%sReverted to %s: %d files rewritten, %d unchanged%s\n",
+		   failed ? YELLOW : GREEN, time_str, rewritten, unchanged, RESET);
+	if (missing)
+		say("%s%d files had no version saved by then and were left alone%s\n",
+			   YELLOW, missing, RESET);
+	if (failed)
+		say("%s%d files could not be reverted%s\n", RED, failed, RESET);
+	return failed ? ERR_IO : SUCCESS;
+}
+
+/* first occurrence of needle in hay; with SSE2, 16 candidate positions are
+ * filtered at once by comparing the first and last needle bytes */
+const char *
+find_substring(const char *hay, size_t n, const char *needle, size_t m)
+{
+	size_t i = 0;
+
+	if (m == 0)
+		return hay;
+	if (m > n)
+		return NULL;
+
+#ifdef __SSE2__
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[m - 1]);
+
+	for (; i + m + 15 <= n; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+														 _mm_cmpeq_epi8(b, last)));
+		while (mask)
+		{
+			int bit = __builtin_ctz(mask);
+			if (memcmp(hay + i + bit + 1, needle + 1, m > 2 ? m - 2 : 0) == 0)
+				return hay + i + bit;
+			mask &= mask - 1;
+		}
+	}
+#endif
+	return memmem(hay + i, n - i, needle, m);
+}
+
+/* 1 if key was added, 0 if it was already present */
+int
+hashset_add(HashSet *set, uint64_t key)
+{
+	size_t i;
+
+	key |= 1;	/* 0 marks an empty slot */
+	if ((set->count + 1) * 2 > set->size)
+	{
+		HashSet grown = { NULL, set->size ? set->size * 2 : 256, 0 };
+
+		grown.keys = calloc(grown.size, sizeof(uint64_t));
+		for (i = 0; i < set->size; i++)
+			if (set->keys[i])
+				hashset_add(&grown, set->keys[i]);
+		free(set->keys);
+		*set = grown;
+	}
+	for (i = key & (set->size - 1); set->keys[i]; i = (i + 1) & (set->size - 1))
+		if (set->keys[i] == key)
+			return 0;
+	set->keys[i] = key;
+	set->count++;
+	return 1;
+}
+
+int
+hashset_has(const HashSet *set, uint64_t key)
+{
+	size_t i;
+
+	key |= 1;
+	if (!set->size)
+		return 0;
+	for (i = key & (set->size - 1); set->keys[i]; i = (i + 1) & (set->size - 1))
+		if (set->keys[i] == key)
+			return 1;
+	return 0;
+}
+
+/* longest stretch of plain characters every match of an extended regex must
+ * contain, or "" when alternation or optional atoms make that unsafe */
+static void
+regex_literal(const char *re, char *lit, size_t size)
+{
+	char run[MAX_LINE_LENGTH];
+	size_t n = 0;
+	const char *p;
+
+	*lit = '\0';
+	if (strpbrk(re, "|()"))
+		return;
+
+	for (p = re; ; p++)
+	{
+		int plain = *p && !strchr(".[]^$*+?{}\\", *p);
+
+		if (plain && !(p[1] && strchr("*?{", p[1])) && n < sizeof(run) - 1)
+		{
+			run[n++] = *p;
+			continue;
+		}
+		run[n] = '\0';
+		if (n > strlen(lit) && n < size)
+			strcpy(lit, run);
+		n = 0;
+		if (!*p)
+			break;
+		if (*p == '\\' && p[1])
+			p++;
+		else if (*p == '[')
+			while (p[1] && *++p != ']')
+				;
+	}
+}
+
+static void
+grep_blob(const GrepItem *item, Blob *blob, const char *pattern, regex_t *re, FILE *out)
+{
+	const char *p = blob->data, *end = blob->data + blob->len, *hit;
+	size_t m = strlen(pattern);
+
+	while (p < end && (hit = find_substring(p, end - p, pattern, m)))
+	{
+		const char *start = hit, *stop = memchr(hit, '\n', end - hit);
+
+		while (start > blob->data && start[-1] != '\n')
+			start--;
+		if (!stop)
+			stop = end;
+
+		if (re)
+		{
+			char save = *(char *)stop;
+			*(char *)stop = '\0';
+			if (regexec(re, start, 0, NULL, 0) != 0)
+			{
+				*(char *)stop = save;
+				p = stop + 1;
+				continue;
+			}
+			*(char *)stop = save;
+		}
+		if (out)
+			fprintf(out, "%s%s%s:%d:%.*s\n", CYAN, item->name, RESET, item->version,
+					(int)(stop - start), start);
+		else
+			say("%s%s%s:%d:%.*s\n", CYAN, item->name, RESET, item->version,
+				(int)(stop - start), start);
+		p = stop + 1;
+	}
+}
+
+/* searches every stored version, skipping versions of a file whose
+ * checksum matches one already searched, so the result does not depend on
+ * how the work is split; output is file:version:line */
+ErrorCode
+grep(const char *pattern, int extended, const char *filename)
+{
+	EnhancedVersionInfo *info = new_record();
+	GrepItem *items = NULL, *grown;
+	VersionSum *sums = NULL;
+	StrMap names = {0};
+	HashSet seen = {0};
+	regex_t re, *rep = NULL;
+	char literal[MAX_LINE_LENGTH];
+	char path[MAX_PATH * 2];
+	struct stat st;
+	uint64_t record = 0;
+	FILE *fp;
+	int n = 0, workers, w, i, status, *slot;
+	ErrorCode result = SUCCESS;
+	int (*pipes)[2];
+
+	if (!info)
+	{
+		out_of_memory();
+		return ERR_NO_MEMORY;
+	}
+	if (extended)
+	{
+		if (regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB) != 0)
+		{
+			say("%sInvalid regular expression: %s%s\n", RED, pattern, RESET);
+			return ERR_INVALID_PATTERN;
+		}
+		rep = &re;
+		regex_literal(pattern, literal, sizeof(literal));
+		pattern = literal;
+	}
+	if (lock_store(F_RDLCK) != 0 || !(fp = fopen(HISTORY_FILE, "rb")))
+	{
+		if (rep)
+			regfree(rep);
+		return ERR_IO;
+	}
+	/* loose versions are known by the checksums saved with them */
+	if (fstat(fileno(fp), &st) != 0 ||
+		!(sums = sums_load(st.st_size / sizeof(EnhancedVersionInfo))))
+		result = ERR_NO_MEMORY;
+
+	for (; result == SUCCESS && fread(info, sizeof(EnhancedVersionInfo), 1, fp) == 1; record++)
+	{
+		char *name;
+
+		if (filename && strcmp(info->filename, filename) != 0)
+			continue;
+		if (!(slot = strmap_get(&names, info->filename)))
+		{
+			if (!(name = arena_alloc(strlen(info->filename) + 1)))
+			{
+				result = ERR_NO_MEMORY;
+				break;
+			}
+			strmap_put(&names, strcpy(name, info->filename), 0);
+			slot = strmap_get(&names, name);
+		}
+		if (!(n & (n - 1)))
+		{
+			if (!(grown = realloc(items, (n ? n * 2 : 64) * sizeof(GrepItem))))
+			{
+				result = ERR_NO_MEMORY;
+				break;
+			}
+			items = grown;
+		}
+		items[n].name = names.keys[slot - names.vals];
+		items[n].version = info->version;
+		items[n].sum = sums[record].data;
+
+		/* duplicates drop out here, before the work is split; a version
+		 * without a known checksum is always searched */
+		snprintf(path, sizeof(path), "%s/%s.%d", BACKUP_DIR, info->filename, info->version);
+		if (access(path, F_OK) != 0 && (i = pack_find(info->filename, info->version)) >= 0)
+			items[n].sum = pack.entries[i].sum;
+		if (items[n].sum &&
+			!hashset_add(&seen, items[n].sum ^ xxh64(info->filename, strlen(info->filename), 0)))
+			continue;
+		n++;
+	}
+	fclose(fp);
+	free(sums);
+	free(seen.keys);
+	strmap_clear(&names, 0);
+	if (result != SUCCESS)
+		out_of_memory();
+
+	workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1)
+		workers = 1;
+	if (workers > n / 8 + 1)
+		workers = n / 8 + 1;
+	pipes = malloc(workers * sizeof(*pipes));
+	fflush(stdout);
+
+	/* each worker takes a contiguous run so output stays in history order */
+	for (w = 0; w < workers; w++)
+	{
+		pid_t pid = -1;
+
+		if (workers > 1 && pipe(pipes[w]) == 0)
+		{
+			if ((pid = fork()) > 0)
+			{
+				close(pipes[w][1]);
+				continue;
+			}
+			if (pid < 0)
+			{
+				close(pipes[w][0]);
+				close(pipes[w][1]);
+			}
+		}
+
+		FILE *out = NULL;
+		int lo = (long)n * w / workers, hi = (long)n * (w + 1) / workers;
+
+		if (pid == 0)
+		{
+			close(pipes[w][0]);
+			out = fdopen(pipes[w][1], "w");
+		}
+		else if (workers > 1)
+		{
+			/* no fork: this slice runs in the parent */
+			pipes[w][0] = -1;
+		}
+
+		for (i = lo; i < hi; i++)
+		{
+			ArenaMark mark = arena_mark();
+			Blob blob;
+
+			if (load_version(items[i].name, items[i].version, &blob) == SUCCESS)
+				grep_blob(&items[i], &blob, pattern, rep, out);
+			arena_reset(mark);
+		}
+
+		if (pid == 0)
+		{
+			fclose(out);
+			_exit(0);
+		}
+	}
+
+	for (w = 0; workers > 1 && w < workers; w++)
+	{
+		char buf[65536];
+		ssize_t len;
+
+		if (pipes[w][0] < 0)
+			continue;
+		fflush(stdout);
+		while ((len = read(pipes[w][0], buf, sizeof(buf))) > 0)
+			emit(buf, len);
+		close(pipes[w][0]);
+	}
+	/* a worker that died took part of the output with it */
+	while (workers > 1 && wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			result = ERR_IO;
+
+	free(pipes);
+	free(items);
+	if (rep)
+		regfree(rep);
+	return result;
+}
+
+/* checks history records lo..hi-1 against their checksums and the versions
+ * they save against theirs, noting the outcome of each in state */
+static void
+fsck_range(int fd, const VersionSum *sums, uint64_t lo, uint64_t hi, char *state)
+{
+	EnhancedVersionInfo *info = new_record();
+	char path[MAX_PATH * 2];
+	ErrorCode result;
+	uint64_t i;
+	int loose;
+
+	for (i = lo; info && i < hi; i++)
+	{
+		ArenaMark mark = arena_mark();
+		Blob blob;
+
+		if (pread(fd, info, sizeof(EnhancedVersionInfo), i * sizeof(EnhancedVersionInfo)) !=
+			sizeof(EnhancedVersionInfo) ||
+			(sums[i].record && xxh64(info, sizeof(EnhancedVersionInfo), 0) != sums[i].record))
+		{
+			state[i] = FSCK_RECORD;
+			continue;
+		}
+		info->filename[MAX_PATH - 1] = '\0';
+		snprintf(path, sizeof(path), "%s/%s.%d", BACKUP_DIR, info->filename, info->version);
+		loose = access(path, F_OK) == 0;
+
+		/* packed objects check their own sum on the way out */
+		result = load_version(info->filename, info->version, &blob);
+		if (result == ERR_INVALID_VERSION)
+			state[i] = FSCK_MISSING;
+		else if (result == ERR_IO || (result == SUCCESS && sums[i].data &&
+									  xxh64(blob.data, blob.len, 0) != sums[i].data))
+			state[i] = FSCK_CORRUPT;
+		else if (result != SUCCESS || !sums[i].record || (!sums[i].data && loose))
+			state[i] = FSCK_UNCHECKED;
+		else
+			state[i] = FSCK_OK;
+		arena_reset(mark);
+	}
+}
+
+/* moves a damaged object aside into QUARANTINE_DIR */
+static void
+quarantine_blob(const char *name, const char *data, size_t len)
+{
+	char path[MAX_PATH * 2];
+	Blob blob = { (char *)data, len };
+
+	snprintf(path, sizeof(path), "%s/%s", QUARANTINE_DIR, name);
+	if (write_blob(path, &blob) != SUCCESS)
+		say("%sCould not write %s%s\n", RED, path, RESET);
+}
+
+/* verifies every history record and stored version, one contiguous run
+ * of records per core; with quarantine set, damaged objects are moved to
+ * QUARANTINE_DIR and dropped from the history and pack */
+ErrorCode
+fsck(int quarantine)
+{
+	EnhancedVersionInfo *info = new_record();
+	const size_t at = offsetof(EnhancedVersionInfo, filename);
+	const size_t ver = offsetof(EnhancedVersionInfo, version);
+	char name[MAX_PATH], path[MAX_PATH * 2];
+	int counts[FSCK_MISSING + 1] = {0};
+	int fd, workers, w, slot, version, damaged = 0, moved = 0;
+	char *state, *drop = NULL;
+	HashSet gone = {0};
+	VersionSum *sums;
+	struct stat st;
+	uint64_t n, i;
+
+	if (!info || lock_store(quarantine ? F_WRLCK : F_RDLCK) != 0 ||
+		(quarantine && wal_drain() != SUCCESS) ||
+		(fd = open(HISTORY_FILE, quarantine ? O_RDWR : O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+		return ERR_IO;
+	n = st.st_size / sizeof(EnhancedVersionInfo);
+
+	if (st.st_size % sizeof(EnhancedVersionInfo))
+	{
+		say("%sTorn record at the end of %s (%llu bytes)%s\n", RED, HISTORY_FILE,
+			(unsigned long long)(st.st_size % sizeof(EnhancedVersionInfo)), RESET);
+		damaged++;
+		if (quarantine)
+		{
+			Blob tail;
+			off_t len = st.st_size % sizeof(EnhancedVersionInfo);
+
+			if ((tail.data = arena_alloc(len)) &&
+				pread(fd, tail.data, len, n * sizeof(EnhancedVersionInfo)) == len &&
+				ftruncate(fd, n * sizeof(EnhancedVersionInfo)) == 0)
+			{
+				quarantine_blob("history.tail", tail.data, len);
+				moved++;
+			}
+		}
+	}
+	if (access(PACK_FILE, F_OK) == 0 && pack_open() != 0)
+	{
+		damaged++;
+		if (quarantine)
+		{
+			snprintf(path, sizeof(path), "%s/pack", QUARANTINE_DIR);
+			create_directory(QUARANTINE_DIR);
+			if (rename(PACK_FILE, path) == 0)
+				moved++;
+		}
+	}
+
+	if (!sums_current() && n > 0)
+		say("%s%s is missing or stale, only packed versions can be verified%s\n",
+			YELLOW, SUMS_FILE, RESET);
+	if (!(sums = sums_load(n)))
+	{
+		close(fd);
+		out_of_memory();
+		return ERR_NO_MEMORY;
+	}
+	state = mmap(NULL, n + 1, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (state == MAP_FAILED)
+	{
+		free(sums);
+		close(fd);
+		return ERR_NO_MEMORY;
+	}
+
+	workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1)
+		workers = 1;
+	if (workers > (int)(n / 8) + 1)
+		workers = n / 8 + 1;
+	fflush(stdout);
+
+	/* results land in shared memory, so a slice left to the parent when
+	 * fork fails is no different from one a worker ran */
+	for (w = 0; w < workers; w++)
+	{
+		pid_t pid = workers > 1 ? fork() : -1;
+
+		if (pid > 0)
+			continue;
+		fsck_range(fd, sums, n * w / workers, n * (w + 1) / workers, state);
+		if (pid == 0)
+			_exit(0);
+	}
+	while (workers > 1 && wait(NULL) > 0)
+		;
+	free(sums);
+
+	for (i = 0; i < n; i++)
+	{
+		counts[(int)state[i]]++;
+		if (state[i] == FSCK_OK || state[i] == FSCK_UNCHECKED)
+			continue;
+		damaged++;
+		if (state[i] == FSCK_RECORD)
+		{
+			say("%sHistory record %llu is damaged%s\n", RED, (unsigned long long)i, RESET);
+			if (quarantine && (drop || (drop = calloc(n, 1))) &&
+				pread(fd, info, sizeof(EnhancedVersionInfo), i * sizeof(EnhancedVersionInfo)) ==
+				sizeof(EnhancedVersionInfo))
+			{
+				snprintf(name, sizeof(name), "history.%llu", (unsigned long long)i);
+				quarantine_blob(name, (const char *)info, sizeof(EnhancedVersionInfo));
+				drop[i] = 1;
+				moved++;
+			}
+			continue;
+		}
+
+		if (pread(fd, name, MAX_PATH, i * sizeof(EnhancedVersionInfo) + at) != MAX_PATH ||
+			pread(fd, &version, sizeof(int), i * sizeof(EnhancedVersionInfo) + ver) != sizeof(int))
+			continue;
+		name[MAX_PATH - 1] = '\0';
+		say("%s%s version %d is %s%s\n", RED, name, version,
+			state[i] == FSCK_MISSING ? "missing" : "corrupt", RESET);
+		if (!quarantine || state[i] == FSCK_MISSING || (!drop && !(drop = calloc(n, 1))))
+			continue;
+
+		/* the loose copy shadows the pack, so it goes first; either way
+		 * the record goes too, as nothing is left for it to point at */
+		snprintf(path, sizeof(path), "%s/%s.%d", BACKUP_DIR, name, version);
+		if (access(path, F_OK) == 0)
+		{
+			char dest[MAX_PATH * 2];
+
+			snprintf(dest, sizeof(dest), "%s/%s.%d", QUARANTINE_DIR, name, version);
+			make_parents(dest);
+			if (rename(path, dest) == 0)
+				drop[i] = 1, moved++;
+		}
+		else if ((slot = pack_find(name, version)) >= 0)
+		{
+			snprintf(path, sizeof(path), "%s.%d.packed", name, version);
+			quarantine_blob(path, pack.map + pack.entries[slot].offset, pack.entries[slot].length);
+			hashset_add(&gone, xxh64(name, strlen(name), version));
+			drop[i] = 1, moved++;
+		}
+	}
+	munmap(state, n + 1);
+	close(fd);
+
+	/* history first: a crash in between leaves unused objects behind,
+	 * never records pointing at missing ones */
+	if (drop && prune_history(drop, n) != SUCCESS)
+		say("%sCould not rewrite %s%s\n", RED, HISTORY_FILE, RESET);
+	else if (gone.count > 0 && prune_pack(&gone) != SUCCESS)
+		say("%sCould not rewrite %s%s\n", RED, PACK_FILE, RESET);
+	free(gone.keys);
+	free(drop);
+
+	say("%sChecked %llu versions on %d worker%s: %d damaged, %d missing, %d without checksum%s\n",
+		damaged ? RED : GREEN, (unsigned long long)n, workers, workers == 1 ? "" : "s",
+		counts[FSCK_RECORD] + counts[FSCK_CORRUPT], counts[FSCK_MISSING],
+		counts[FSCK_UNCHECKED], RESET);
+	if (moved)
+		say("%sMoved %d damaged object%s to %s%s\n", YELLOW, moved, moved == 1 ? "" : "s",
+			QUARANTINE_DIR, RESET);
+	return damaged ? ERR_CORRUPT : SUCCESS;
+}
+
+/* moves len bytes between descriptors, through splice when either side is
+ * a pipe and copy_file_range between regular files, else read/write */
+int
+transfer(int in, off_t *in_off, int out, uint64_t len)
+{
+	static char buf[65536];
+	struct stat a, b;
+	int pipe_io, file_io;
+	ssize_t n;
+
+	fstat(in, &a);
+	fstat(out, &b);
+	pipe_io = S_ISFIFO(a.st_mode) || S_ISFIFO(b.st_mode);
+	file_io = S_ISREG(a.st_mode) && S_ISREG(b.st_mode);
+
+	while (len > 0)
+	{
+		size_t chunk = len < (1 << 20) ? len : (1 << 20);
+
+		n = -1;
+		if (pipe_io)
+			n = splice(in, in_off, out, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+		else if (file_io)
+			n = copy_file_range(in, in_off, out, NULL, chunk, 0);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EINVAL && errno != ENOSYS && errno != EXDEV &&
+				errno != EOPNOTSUPP && errno != EBADF)
+				return -1;
+			pipe_io = file_io = 0;
+
+			chunk = chunk < sizeof(buf) ? chunk : sizeof(buf);
+			n = in_off ? pread(in, buf, chunk, *in_off) : read(in, buf, chunk);
+			if (n > 0 && write_all(out, buf, n) != 0)
+				return -1;
+			if (n > 0 && in_off)
+				*in_off += n;
+		}
+		if (n <= 0)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+static uint64_t
+file_sum(int fd, uint64_t size)
+{
+	uint64_t sum;
+	void *map;
+
+	if (size == 0)
+		return xxh64("", 0, 0);
+	if ((map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		return 0;
+	sum = xxh64(map, size, 0);
+	munmap(map, size);
+	return sum;
+}
+
+static int
+export_dir(int out, const char *dir, int *files, uint64_t *bytes)
+{
+	char path[MAX_PATH * 2];
+	struct dirent *entry;
+	struct stat st;
+	DIR *d;
+	int result = 0;
+
+	if (!(d = opendir(dir)))
+		return -1;
+	while (result == 0 && (entry = readdir(d)))
+	{
+		const char *name = entry->d_name;
+		size_t l = strlen(name);
+
+		/* runtime state and temporaries are not part of the repository */
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+			(strcmp(dir, VCS_DIR) == 0 &&
+			 (strcmp(name, "lock") == 0 || strcmp(name, "sock") == 0 ||
+			  strcmp(name, "wal") == 0 || strncmp(name, "timeidx", 7) == 0 ||
+			  (strcmp(name, "sums") == 0 && !sums_current()))) ||
+			(l > 4 && strcmp(name + l - 4, ".tmp") == 0))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		if (lstat(path, &st) != 0)
+			continue;
+		if (S_ISDIR(st.st_mode))
+		{
+			result = export_dir(out, path, files, bytes);
+		}
+		else if (S_ISREG(st.st_mode))
+		{
+			ArchiveSection sec = {"FILE", 0, st.st_size, 0};
+			const char *rel = path + strlen(VCS_DIR) + 1;
+			off_t off = 0;
+			int fd = open(path, O_RDONLY);
+
+			if (fd < 0)
+				return -1;
+			sec.name_len = strlen(rel);
+			sec.sum = file_sum(fd, st.st_size);
+			if (write_all(out, &sec, sizeof(sec)) != 0 ||
+				write_all(out, rel, sec.name_len) != 0 ||
+				transfer(fd, &off, out, st.st_size) != 0)
+				result = -1;
+			close(fd);
+			(*files)++;
+			*bytes += st.st_size;
+		}
+	}
+	closedir(d);
+	return result;
+}
+
+/* streams the whole of VCS_DIR as one archive while writers are held off */
+ErrorCode
+export_repo(const char *target)
+{
+	ArchiveSection end = {"END", 0, 0, 0};
+	char magic[8] = ARCHIVE_MAGIC;
+	uint64_t bytes = 0;
+	off_t wal_end;
+	int out, wal_fd, saved = -1, files = 0, result;
+
+	if (strcmp(target, "-") == 0)
+	{
+		if (isatty(STDOUT_FILENO))
+		{
+			say("%sRefusing to write an archive to a terminal%s\n", RED, RESET);
+			return ERR_IO;
+		}
+		/* keep the stream clean: messages go to stderr until we are done */
+		fflush(stdout);
+		saved = dup(STDOUT_FILENO);
+		out = dup(STDOUT_FILENO);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	}
+	else if ((out = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+	{
+		say("%sCannot create %s: %s%s\n", RED, target, strerror(errno), RESET);
+		return ERR_IO;
+	}
+
+	/* the store lock waits out savers and gc, the log lock index updates */
+	if (lock_store(F_WRLCK) != 0 || (wal_fd = open(WAL_FILE, O_RDWR | O_CREAT, 0644)) < 0)
+	{
+		result = -1;
+	}
+	else
+	{
+		flock(wal_fd, LOCK_EX);
+		/* the archive carries applied files rather than a log to replay */
+		if (wal_replay(wal_fd, &wal_end) == SUCCESS && wal_end > 0)
+			wal_checkpoint(wal_fd);
+
+		result = write_all(out, magic, sizeof(magic));
+		if (result == 0)
+			result = export_dir(out, VCS_DIR, &files, &bytes);
+		end.size = files;
+		if (result == 0)
+			result = write_all(out, &end, sizeof(end));
+		close(wal_fd);
+	}
+
+	if (close(out) != 0)
+		result = -1;
+	if (result != 0)
+		say("%sExport failed: %s%s\n", RED, strerror(errno), RESET);
+	else
+		say("%sExported %d files, %llu bytes%s\n", GREEN, files,
+			   (unsigned long long)bytes, RESET);
+
+	if (saved >= 0)
+	{
+		fflush(stdout);
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+	}
+	return result == 0 ? SUCCESS : ERR_IO;
+}
+
+static void
+remove_tree(const char *dir)
+{
+	char path[MAX_PATH * 2];
+	struct dirent *entry;
+	struct stat st;
+	DIR *d = opendir(dir);
+
+	if (!d)
+		return;
+	while ((entry = readdir(d)))
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode))
+			remove_tree(path);
+		else
+			unlink(path);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+static int
+read_exact(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0)
+	{
+		if ((n = read(fd, p, len)) <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* 1 if name is absolute or has a ".." component */
+static int
+unsafe_path(const char *name)
+{
+	const char *p;
+
+	if (name[0] == '/')
+		return 1;
+	for (p = name; p; p = (p = strchr(p, '/')) ? p + 1 : NULL)
+		if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+			return 1;
+	return 0;
+}
+
+/* unpacks an archive into IMPORT_DIR, verifying every section, and only
+ * renames it to VCS_DIR once the whole stream checked out */
+ErrorCode
+import_repo(const char *source)
+{
+	ArchiveSection sec;
+	char magic[8];
+	char name[MAX_PATH];
+	char path[MAX_PATH * 2];
+	int in, fd, files = 0;
+	const char *error = NULL;
+
+	if (access(VCS_DIR, F_OK) == 0)
+	{
+		say("%sRepository already exists!%s\n", YELLOW, RESET);
+		return ERR_FILE_EXISTS;
+	}
+	if (strcmp(source, "-") == 0)
+		in = STDIN_FILENO;
+	else if ((in = open(source, O_RDONLY)) < 0)
+	{
+		say("%sCannot open %s: %s%s\n", RED, source, strerror(errno), RESET);
+		return ERR_NO_FILE;
+	}
+
+	remove_tree(IMPORT_DIR);
+	create_directory(IMPORT_DIR);
+
+	if (read_exact(in, magic, sizeof(magic)) != 0 || memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) != 0)
+		error = "not an ew archive";
+
+	while (!error)
+	{
+		if (read_exact(in, &sec, sizeof(sec)) != 0)
+		{
+			error = "truncated archive";
+			break;
+		}
+		if (memcmp(sec.type, "END", 4) == 0)
+		{
+			if (sec.size != (uint64_t)files)
+				error = "section count mismatch";
+			break;
+		}
+		if (memcmp(sec.type, "FILE", 4) != 0 || sec.name_len == 0 || sec.name_len >= MAX_PATH ||
+			read_exact(in, name, sec.name_len) != 0)
+		{
+			error = "corrupt section header";
+			break;
+		}
+		name[sec.name_len] = '\0';
+		if (unsafe_path(name) || memchr(name, '\0', sec.name_len))
+		{
+			error = "unsafe path in archive";
+			break;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", IMPORT_DIR, name);
+		make_parents(path);
+		if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		{
+			error = strerror(errno);
+			break;
+		}
+		if (transfer(in, NULL, fd, sec.size) != 0)
+			error = "truncated archive";
+		else if (file_sum(fd, sec.size) != sec.sum)
+			error = "checksum mismatch";
+		close(fd);
+		if (error)
+			say("%s%s: %s%s\n", RED, name, error, RESET);
+		files++;
+	}
+	if (in != STDIN_FILENO)
+		close(in);
+
+	/* checksums are tied to the history's inode, which the copy changed */
+	if (!error)
+	{
+		struct stat st;
+		SumsHeader header;
+
+		snprintf(name, sizeof(name), "%s/%s", IMPORT_DIR, HISTORY_FILE + sizeof(VCS_DIR));
+		snprintf(path, sizeof(path), "%s/%s", IMPORT_DIR, SUMS_FILE + sizeof(VCS_DIR));
+		if (stat(name, &st) == 0 && (fd = open(path, O_RDWR)) >= 0)
+		{
+			if (pread(fd, &header, sizeof(SumsHeader), 0) == sizeof(SumsHeader))
+			{
+				header.ino = st.st_ino;
+				pwrite(fd, &header, sizeof(SumsHeader), 0);
+			}
+			close(fd);
+		}
+	}
+
+	if (!error && rename(IMPORT_DIR, VCS_DIR) != 0)
+		error = strerror(errno);
+	if (error)
+	{
+		remove_tree(IMPORT_DIR);
+		say("%sImport failed: %s%s\n", RED, error, RESET);
+		return ERR_IO;
+	}
+	say("%sImported %d files%s\n", GREEN, files, RESET);
+	return SUCCESS;
+}
+
+Command
+parse_command(const char *name)
+{
+	if (strcmp(name, "init") == 0)      return CMD_INIT;
+	if (strcmp(name, "diff") == 0)      return CMD_DIFF;
+	if (strcmp(name, "find") == 0)      return CMD_FIND;
+	if (strcmp(name, "save") == 0)      return CMD_SAVE;
+	if (strcmp(name, "revert") == 0)    return CMD_REVERT;
+	if (strcmp(name, "history") == 0)   return CMD_HISTORY;
+	if (strcmp(name, "status") == 0)    return CMD_STATUS;
+	if (strcmp(name, "track") == 0)     return CMD_TRACK;
+	if (strcmp(name, "untrack") == 0)   return CMD_UNTRACK;
+	if (strcmp(name, "daemon") == 0)    return CMD_DAEMON;
+	if (strcmp(name, "gc") == 0)        return CMD_GC;
+	if (strcmp(name, "snapshot") == 0)  return CMD_SNAPSHOT;
+	if (strcmp(name, "restore") == 0)   return CMD_RESTORE;
+	if (strcmp(name, "grep") == 0)      return CMD_GREP;
+	if (strcmp(name, "export") == 0)    return CMD_EXPORT;
+	if (strcmp(name, "import") == 0)    return CMD_IMPORT;
+	if (strcmp(name, "prune") == 0)     return CMD_PRUNE;
+	if (strcmp(name, "mv") == 0)        return CMD_MV;
+	if (strcmp(name, "fsck") == 0)      return CMD_FSCK;
+	return CMD_UNKNOWN;
+}
+
+/* everything a command reports goes through here: to the repository's
+ * output callback if it has one, else straight to stdout */
+void
+say(const char *fmt, ...)
+{
+	char buf[4096], *text = buf;
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	if (!repo || !repo->output)
+	{
+		vprintf(fmt, ap);
+		va_end(ap);
+		return;
+	}
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (len >= (int)sizeof(buf))
+	{
+		if ((text = malloc(len + 1)))
+		{
+			va_start(ap, fmt);
+			vsnprintf(text, len + 1, fmt, ap);
+			va_end(ap);
+		}
+		else
+		{
+			text = buf;
+			len = sizeof(buf) - 1;
+		}
+	}
+	if (len > 0)
+		repo->output(repo->ctx, text, len);
+	if (text != buf)
+		free(text);
+}
+
+/* passes through output that is already formatted, e.g. from workers */
+void
+emit(const char *text, size_t len)
+{
+	if (repo && repo->output)
+	{
+		repo->output(repo->ctx, text, len);
+		return;
+	}
+	fflush(stdout);
+	write_all(STDOUT_FILENO, text, len);
+}
+
+/* moves into the repository root; returns the old directory for leave() */
+int
+enter(EwRepo *r)
+{
+	int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (cwd < 0)
+		return -1;
+	if (fchdir(r->dir) != 0)
+	{
+		close(cwd);
+		return -1;
+	}
+	if (repo != r && lock_fd >= 0)
+	{
+		/* the lock file belongs to the previous repository */
+		close(lock_fd);
+		lock_fd = -1;
+	}
+	repo = r;
+	return cwd;
+}
+
+void
+leave(int cwd)
+{
+	fflush(stdout);
+	fchdir(cwd);
+	close(cwd);
+}
+
+ErrorCode
+run(EwRepo *r, Command cmd, int argc, char *argv[])
+{
+	ErrorCode result;
+	int cwd;
+
+	if ((cwd = enter(r)) < 0)
+		return ERR_IO;
+	if (repo->cache.loaded)
+		cache_sync(cmd == CMD_STATUS);
+
+	result = handle_command(cmd, argc, argv);
+	if (wal_commit() != SUCCESS && result == SUCCESS)
+		result = ERR_IO;
+	unlock_all();
+	arena_release();
+
+	leave(cwd);
+	return result;
+}
+
+EwRepo *
+ew_open(const char *path, int flags, ErrorCode *error)
+{
+	EwRepo *r = calloc(1, sizeof(EwRepo));
+	ErrorCode result = SUCCESS;
+	int cwd;
+
+	if (!arena.limit)
+		arena_init();
+
+	if (!r)
+		result = ERR_NO_MEMORY;
+	else if ((r->dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		result = ERR_NO_REPO;
+	else if ((cwd = enter(r)) < 0)
+		result = ERR_IO;
+	else
+	{
+		/* finish whatever an interrupted writer left in the log */
+		if (access(VCS_DIR, F_OK) == 0)
+		{
+			wal_recover();
+			if (flags & EW_OPEN_CACHED)
+				cache_load();
+		}
+		arena_release();
+		leave(cwd);
+	}
+
+	if (result != SUCCESS && r)
+	{
+		if (r->dir >= 0)
+			close(r->dir);
+		free(r);
+		r = NULL;
+	}
+	if (error)
+		*error = result;
+	return r;
+}
+
+void
+ew_close(EwRepo *r)
+{
+	if (!r)
+		return;
+	if (repo == r)
+	{
+		if (lock_fd >= 0)
+		{
+			close(lock_fd);
+			lock_fd = -1;
+		}
+		cache_free();
+		repo = NULL;
+	}
+	else
+	{
+		EwRepo *prev = repo;
+
+		repo = r;
+		cache_free();
+		repo = prev;
+	}
+	close(r->dir);
+	free(r);
+}
+
+void
+ew_set_output(EwRepo *r, EwOutput output, void *ctx)
+{
+	r->output = output;
+	r->ctx = ctx;
+}
+
+void
+ew_set_color(EwRepo *r, int color)
+{
+	r->color = color;
+}
+
+ErrorCode
+ew_run(EwRepo *r, int argc, char *argv[])
+{
+	if (argc < 2)
+		return ERR_UNKNOWN_COMMAND;
+	return run(r, parse_command(argv[1]), argc, argv);
+}
+
+int
+ew_forward(EwRepo *r, int argc, char *argv[])
+{
+	int cwd, rc;
+
+	if ((cwd = enter(r)) < 0)
+		return -1;
+	rc = daemon_request(argc, argv);
+	leave(cwd);
+	return rc;
+}
+
+ErrorCode
+ew_track(EwRepo *r, const char *path)
+{
+	char *argv[] = { "ew", "track", (char *)path, NULL };
+
+	return run(r, CMD_TRACK, 3, argv);
+}
+
+ErrorCode
+ew_untrack(EwRepo *r, const char *path)
+{
+	char *argv[] = { "ew", "untrack", (char *)path, NULL };
+
+	return run(r, CMD_UNTRACK, 3, argv);
+}
+
+ErrorCode
+ew_save(EwRepo *r, const char *path, int *version)
+{
+	char *argv[] = { "ew", "save", (char *)path, NULL };
+	ErrorCode result;
+
+	r->saved = 0;
+	result = run(r, CMD_SAVE, 3, argv);
+	if (version)
+		*version = result == SUCCESS ? r->saved : 0;
+	return result;
+}
+
+ErrorCode
+ew_diff(EwRepo *r, const char *path)
+{
+	char *argv[] = { "ew", "diff", (char *)path, NULL };
+
+	return run(r, CMD_DIFF, 3, argv);
+}
+
+ErrorCode
+ew_revert(EwRepo *r, const char *path, int version)
+{
+	char buf[16];
+	char *argv[] = { "ew", "revert", (char *)path, buf, NULL };
+
+	snprintf(buf, sizeof(buf), "%d", version);
+	return run(r, CMD_REVERT, 4, argv);
+}
+
+ErrorCode
+ew_status(EwRepo *r, EwStatusFn fn, void *ctx)
+{
+	EwFileStatus file;
+	int cwd, i, loaded;
+
+	if ((cwd = enter(r)) < 0)
+		return ERR_IO;
+	if (access(VCS_DIR, F_OK) != 0)
+	{
+		leave(cwd);
+		return ERR_NO_REPO;
+	}
+
+	if ((loaded = repo->cache.loaded))
+		cache_sync(1);
+	else
+		cache_load();
+
+	for (i = 0; i < repo->cache.count; i++)
+	{
+		if (!repo->cache.files[i].is_tracked)
+			continue;
+		file.path = repo->cache.files[i].path;
+		file.state = repo->cache.state[i];
+		file.version = latest_version(file.path);
+		if (fn(ctx, &file) != 0)
+			break;
+	}
+
+	if (!loaded)
+		cache_free();
+	arena_release();
+	leave(cwd);
+	return SUCCESS;
+}